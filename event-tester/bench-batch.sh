@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Compare tcp_echo's per-completion dispatch with its batch dispatch (-b)
+# on an upcall build of the event tester:
+#
+#	./bench-batch.sh [runs] [tcp_client options...]
+#
+# Each run starts tcp_echo on loopback, once without and once with -b,
+# drives it with tcp_client and prints the server's counters from the
+# perf-stats.tsv tcp_client saves, summed over its workers.  CALLBACK_CYCLES
+# and ICACHE_MISSES per completion are the numbers to compare; BATCHED /
+# BATCHES is how many reads a batch_fn call got on average.  The perf
+# counters read 0 where perf_event_open is not available.
+#
+# TSC_KHZ (default: cpu MHz from /proc/cpuinfo), PORT (default 7272) and
+# UPCALL_BACKEND are taken from the environment.  Every server gets a
+# port pair of its own from PORT up, as the stats port of the last one is
+# still in TIME_WAIT.
+
+RUNS=${1:-3}
+shift
+CLIENT_ARGS=${@:--t 200 -b 200 -c 8}
+TSC_KHZ=${TSC_KHZ:-$(awk -F: '/cpu MHz/ { printf "%d", $2 * 1000; exit }' /proc/cpuinfo)}
+PORT=${PORT:-7272}
+TSV=bench-batch.tsv
+
+cd "$(dirname "$0")"
+
+# Sum the named columns over every row of the stats file
+report() {
+	awk -F'\t' -v mode="$1" '
+		NR == 1 { for (i = 1; i <= NF; i++) col[$i] = i; next }
+		{
+			comp += $col["COMPLETIONS"]
+			cb   += $col["CALLBACK_CYCLES"]
+			ic   += $col["ICACHE_MISSES"]
+			bat  += $col["BATCHES"]
+			bd   += $col["BATCHED"]
+		}
+		END {
+			printf "%-6s completions %d  cycles/completion %.0f  icache misses/completion %.2f  batches %d  reads/batch %.2f\n",
+				mode, comp, comp ? cb / comp : 0, comp ? ic / comp : 0,
+				bat, bat ? bd / bat : 0
+		}' $TSV
+}
+
+for run in $(seq $RUNS); do
+	for mode in plain batch; do
+		ECHO_ARGS=
+		[ $mode = batch ] && ECHO_ARGS=-b
+		STATS=$((PORT + 1))
+
+		./tcp_echo -p $PORT -s $STATS $ECHO_ARGS > /dev/null 2>&1 &
+		echo_pid=$!
+		sleep 1
+
+		rm -f $TSV
+		if ! ./tcp_client -p $PORT -s $STATS -S $TSV $CLIENT_ARGS \
+				127.0.0.1 $TSC_KHZ > /dev/null 2>&1; then
+			echo "run $run $mode: tcp_client failed" >&2
+			kill $echo_pid 2> /dev/null
+			exit 1
+		fi
+		kill $echo_pid
+		wait $echo_pid 2> /dev/null
+		PORT=$((PORT + 2))
+
+		echo -n "run $run "
+		report $mode
+	done
+done
+rm -f $TSV timers.tsv
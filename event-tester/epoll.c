@@ -28,6 +28,7 @@ extern __thread struct worker_thread *me;
 extern __thread struct buffer_cache *msg_cache;
 extern __thread struct buffer_cache *conn_cache;
 extern struct worker_thread **threads;
+extern int *worker_cpus;
 extern struct connection **conns;
 extern size_t init_count;
 extern size_t msg_size;
@@ -81,7 +82,7 @@ void on_accept(void *arg)
 			exit(1);
 		}
 
-		owner = threads[cpu];
+		owner = cpu_owner(cpu);
 		pthread_mutex_lock(&owner->incoming.lock);
 		newbie->next = owner->incoming.list;
 		owner->incoming.list = newbie;
@@ -208,6 +209,7 @@ static void *worker_func(void *arg)
 
 	// Do our setup
 	me->index = my_cpu;
+	me->cpu = worker_cpus[my_cpu];
 
 	threads[my_cpu] = me;
 	me->event_fd = eventfd(0, EFD_NONBLOCK);
@@ -278,7 +280,7 @@ static void *worker_func(void *arg)
 		exit(1);
 	}
 	
-	setup_perf(me->perf_fds, me->perf_ids, me->index);
+	setup_perf(me->perf_fds, me->perf_ids, me->cpu);
 
 	// Notify that setup is done
 	pthread_mutex_lock(&init_lock);
@@ -348,7 +350,7 @@ void init_threads(uint64_t nr_cpus)
 	pthread_t dummy;
 	cpu_set_t *worker_cpu;
 
-	worker_cpu = CPU_ALLOC(nr_cpus);
+	worker_cpu = CPU_ALLOC(CPU_SETSIZE);
 
 	if (pthread_attr_init(&attrs)) {
 		perror("Failed to initialize pthread_attrs");
@@ -365,9 +367,9 @@ void init_threads(uint64_t nr_cpus)
 	pthread_create(&dummy, &attrs, dummy_worker, NULL);
 
 	for (uint64_t i = 0; i < nr_cpus; i++) {
-		CPU_ZERO_S(CPU_ALLOC_SIZE(nr_cpus), worker_cpu);
-		CPU_SET_S(i, CPU_ALLOC_SIZE(nr_cpus), worker_cpu);
-		if (pthread_attr_setaffinity_np(&attrs, CPU_ALLOC_SIZE(nr_cpus), worker_cpu)) {
+		CPU_ZERO_S(CPU_ALLOC_SIZE(CPU_SETSIZE), worker_cpu);
+		CPU_SET_S(worker_cpus[i], CPU_ALLOC_SIZE(CPU_SETSIZE), worker_cpu);
+		if (pthread_attr_setaffinity_np(&attrs, CPU_ALLOC_SIZE(CPU_SETSIZE), worker_cpu)) {
 			perror("Cannot set affinity in attr");
 			exit(1);
 		}
@@ -419,3 +421,7 @@ int close_from_io(struct connection *conn)
 
 void workers_go(void) {}
 
+const char *engine_stats_header(void) { return ""; }
+
+void engine_stats(int worker_id, char *buf, size_t len) { buf[0] = '\0'; }
+
@@ -30,6 +30,7 @@ extern __thread struct buffer_cache *msg_cache;
 extern __thread struct buffer_cache *conn_cache;
 __thread struct buffer_cache *info_cache;
 extern struct worker_thread **threads;
+extern int *worker_cpus;
 extern struct connection **conns;
 extern size_t init_count;
 extern size_t msg_size;
@@ -126,6 +127,7 @@ static void *worker_func(void *arg)
 
 	// Do our setup
 	me->index = my_cpu;
+	me->cpu = worker_cpus[my_cpu];
 
 	threads[my_cpu] = me;
 	me->event_fd = eventfd(0, 0);
@@ -181,7 +183,7 @@ static void *worker_func(void *arg)
 		exit(1);
 	}
 
-	setup_perf(me->perf_fds, me->perf_ids, me->index);
+	setup_perf(me->perf_fds, me->perf_ids, me->cpu);
 
 	memset(&uring_params, 0, sizeof(struct io_uring_params));
 
@@ -252,7 +254,7 @@ static void *worker_func(void *arg)
 					exit(1);
 				}
 
-				owner = threads[cpu];
+				owner = cpu_owner(cpu);
 				if (owner != me) {
 					u = malloc(sizeof(uint64_t));
 					*u = CONN_EVENT;
@@ -354,7 +356,7 @@ void init_threads(uint64_t nr_cpus)
 	pthread_t dummy;
 	cpu_set_t *worker_cpu;
 
-	worker_cpu = CPU_ALLOC(nr_cpus);
+	worker_cpu = CPU_ALLOC(CPU_SETSIZE);
 	if (pthread_attr_init(&attrs)) {
 		perror("Failed to initialize pthread_attrs");
 		exit(1);
@@ -368,9 +370,9 @@ void init_threads(uint64_t nr_cpus)
 	pthread_mutex_lock(&worker_hang_lock);
 
 	for (uint64_t i = 0; i < nr_cpus; i++) {
-		CPU_ZERO_S(CPU_ALLOC_SIZE(nr_cpus), worker_cpu);
-		CPU_SET_S(i, CPU_ALLOC_SIZE(nr_cpus), worker_cpu);
-		if (pthread_attr_setaffinity_np(&attrs, CPU_ALLOC_SIZE(nr_cpus), worker_cpu)) {
+		CPU_ZERO_S(CPU_ALLOC_SIZE(CPU_SETSIZE), worker_cpu);
+		CPU_SET_S(worker_cpus[i], CPU_ALLOC_SIZE(CPU_SETSIZE), worker_cpu);
+		if (pthread_attr_setaffinity_np(&attrs, CPU_ALLOC_SIZE(CPU_SETSIZE), worker_cpu)) {
 			perror("Cannot set affinity in attr");
 			exit(1);
 		}
@@ -394,3 +396,7 @@ void init_threads(uint64_t nr_cpus)
 
 void workers_go(void) {}
 
+const char *engine_stats_header(void) { return ""; }
+
+void engine_stats(int worker_id, char *buf, size_t len) { buf[0] = '\0'; }
+
@@ -27,6 +27,10 @@
 
 #include "echo_defs.h"
 
+#ifdef ENABLE_LIBUPCALL
+#include "../libupcall/upcall.h"
+#endif
+
 #ifndef CLIENTS_PER_THREAD
 #define CLIENTS_PER_THREAD 1
 #endif
@@ -123,6 +127,9 @@ static void usage(void)
 	CONT("Default is timers.tsv");
 	OPTION("--perf-stats,-S [name]", "Use [name] for the perf stats tab seperated value file.");
 	CONT("Default is perf-stats.tsv");
+#ifdef ENABLE_LIBUPCALL
+	OPTION("--upcall,-u", "Drive the clients from libupcall workers instead of epoll.");
+#endif
 }
 
 extern int errno;
@@ -396,14 +403,12 @@ static void cleanup(struct worker *me)
 	}
 }
 
-static void *worker_func(void *arg)
+/*
+ * Allocate a worker's timer log and clients, common to both engines.
+ */
+static void worker_init(struct worker *me)
 {
 	size_t i, j;
-	size_t complete = 0;
-	size_t total = transaction_count * clients_per_thread;
-	int rdy;
-	struct epoll_event *events;
-	struct worker *me = (struct worker*)arg;
 
 	/*
 	 * Include an extra cache line size to ensure that we can align the beginning
@@ -425,24 +430,12 @@ static void *worker_func(void *arg)
 	me->log->hdr.info.overflow = 0;
 	me->log->hdr.info.valperentry = 4;
 
-	me->epoll_fd = epoll_create1(0);
-	if (me->epoll_fd < 0) {
-		perror("epoll_create1():");
-		exit(1);
-	}
-	
 	me->clients = calloc(clients_per_thread, sizeof(struct client));
 	if (!me->clients) {
 		perror("OOM");
 		exit(1);
 	}
 
-	events = calloc(EVENT_BACKLOG, sizeof(struct epoll_event));
-	if (!events) {
-		perror("OOM");
-		exit(1);
-	}
-
 	for (i = 0; i < clients_per_thread; i++) {
 		me->clients[i].buf = malloc(msg_size);
 		if (!me->clients[i].buf) {
@@ -460,6 +453,30 @@ static void *worker_func(void *arg)
 		me->clients[i].txn_remaining = transaction_count;
 		me->clients[i].batch_remaining = batch_size;
 	}
+}
+
+static void *worker_func(void *arg)
+{
+	size_t i, j;
+	size_t complete = 0;
+	size_t total = transaction_count * clients_per_thread;
+	int rdy;
+	struct epoll_event *events;
+	struct worker *me = (struct worker*)arg;
+
+	worker_init(me);
+
+	me->epoll_fd = epoll_create1(0);
+	if (me->epoll_fd < 0) {
+		perror("epoll_create1():");
+		exit(1);
+	}
+
+	events = calloc(EVENT_BACKLOG, sizeof(struct epoll_event));
+	if (!events) {
+		perror("OOM");
+		exit(1);
+	}
 
 	// Setup Complete
 	pthread_mutex_lock(&init_lock);
@@ -512,6 +529,372 @@ out_err:
 	return NULL;
 }
 
+#ifdef ENABLE_LIBUPCALL
+/*
+ * The upcall engine runs the same client state machine on libupcall
+ * workers, one per CPU the epoll threads would have used, so both ends of
+ * a transaction can run on upcalls.  Connects, sends and receives are
+ * libupcall actions and their callbacks move the clients along.
+ */
+#define UPCALL_TICK_US		1000000
+#define UPCALL_IDLE_TICKS	10
+
+static int use_upcall;
+static struct client **sock_clients;	/* indexed by socket */
+static int max_sock;
+static size_t workers_done;
+
+static __thread struct worker *up_me;
+static __thread size_t up_complete;
+static __thread size_t up_seen;
+static __thread int up_idle;
+static __thread bool up_finished;
+static __thread struct upcall_timer up_watchdog;
+
+static int up_state_transition(struct worker *me, uint32_t j);
+
+static struct client *up_client(int sock)
+{
+	if (sock < 0 || sock >= max_sock || !sock_clients[sock]) {
+		fprintf(stderr, "No client for socket %d\n", sock);
+		set_dying();
+		return NULL;
+	}
+	return sock_clients[sock];
+}
+
+static void up_fail(const char *what, int err)
+{
+	fprintf(stderr, "%s %s\n", what, strerror(err));
+	set_dying();
+}
+
+/* Report this worker done, once, when its clients finish or one dies */
+static void up_check_done(void)
+{
+	if (up_finished)
+		return;
+	if (!up_me->dying && up_complete < transaction_count * clients_per_thread)
+		return;
+
+	up_finished = true;
+	cancel_timer(&up_watchdog);
+	if (!up_me->dying)
+		cleanup(up_me);
+
+	pthread_mutex_lock(&init_lock);
+	workers_done++;
+	pthread_cond_signal(&init_cond);
+	pthread_mutex_unlock(&init_lock);
+}
+
+/* The epoll engine's 10 second epoll_wait timeout, and a dying check */
+static void up_tick(struct up_event *evt)
+{
+	if (up_me->dying) {
+		up_check_done();
+		return;
+	}
+
+	if (up_complete == up_seen && ++up_idle == UPCALL_IDLE_TICKS) {
+		fprintf(stderr, "Nothing happened in 10 seconds after %lu transactions, is the server alive?\n", up_complete);
+		exit(1);
+	}
+	if (up_complete != up_seen)
+		up_idle = 0;
+	up_seen = up_complete;
+
+	add_timer(&up_watchdog, UPCALL_TICK_US, up_tick, NULL);
+}
+
+static void up_connected(struct up_event *evt)
+{
+	struct client *c = up_client(evt->fd);
+	uint32_t j;
+
+	if (!c)
+		goto out;
+	j = c - up_me->clients;
+
+	tsclog_4(up_me->log, up_me->index, j, transaction_count - c->txn_remaining, CONNECT_DONE);
+	if (evt->result < 0) {
+		up_fail("Connection failed:", -evt->result);
+		goto out;
+	}
+
+	// CONNECTING -> READY
+	c->state = READY;
+	up_complete += up_state_transition(up_me, j);
+out:
+	up_check_done();
+}
+
+static void up_received(struct up_event *evt)
+{
+	struct client *c = up_client(evt->fd);
+	size_t len;
+	uint32_t j;
+
+	if (!c)
+		goto out;
+	j = c - up_me->clients;
+
+	if (evt->result == -ENOMEM) {
+		// Out of pool buffers, wait for the next chunk
+		add_read(evt->fd, up_received);
+		goto out;
+	}
+	if (evt->result <= 0) {
+		up_fail("client recv():", evt->result ? -evt->result : ECONNRESET);
+		goto out;
+	}
+
+	tsclog_4(up_me->log, up_me->index, j, transaction_count - c->txn_remaining, RECV_START);
+	len = evt->result;
+	if (len > c->buf_size - c->cursor)
+		len = c->buf_size - c->cursor;
+	memcpy(&c->buf[c->cursor], evt->buf, len);
+	c->cursor += len;
+	return_buffer(evt->buf, evt->len);
+	tsclog_4(up_me->log, up_me->index, j, transaction_count - c->txn_remaining, RECV_DONE);
+
+	up_complete += up_state_transition(up_me, j);
+out:
+	up_check_done();
+}
+
+static void up_sent(struct up_event *evt)
+{
+	struct client *c = up_client(evt->fd);
+
+	if (!c)
+		goto out;
+
+	tsclog_4(up_me->log, up_me->index, c - up_me->clients,
+		 transaction_count - c->txn_remaining, SEND_DONE);
+	if (evt->result <= 0) {
+		up_fail("client send():", evt->result ? -evt->result : EPIPE);
+		goto out;
+	}
+
+	// Read the echo only now, so no completion can outlive the transaction
+	add_read(evt->fd, up_received);
+out:
+	up_check_done();
+}
+
+/*
+ * do_state_transition() for the upcall engine.  The callbacks above do the
+ * waiting: CONNECTING and SENT are entered once their action is queued and
+ * left when it completes.
+ */
+static int up_state_transition(struct worker *me, uint32_t j)
+{
+	struct client *c = &me->clients[j];
+	struct iovec iov;
+	int optval = 1;
+	int ret;
+
+	switch (c->state) {
+	case INIT:
+		/*
+		 * The specified client does not have a socket, set it up and start connecting.
+		 *
+		 * Valid state transitions from here are: CONNECTING
+		 */
+		c->batch_remaining = batch_size;
+
+		c->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (c->sock < 0) {
+			perror("socket():");
+			set_dying();
+			return 0;
+		}
+		if (c->sock >= max_sock) {
+			fprintf(stderr, "Socket %d is past RLIMIT_NOFILE\n", c->sock);
+			set_dying();
+			return 0;
+		}
+		if (setsockopt(c->sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+			perror("setsockopt(SO_REUSEPORT):");
+			set_dying();
+			return 0;
+		}
+		if (setsockopt(c->sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+			perror("setsockopt(SO_REUSEADDR):");
+			set_dying();
+			return 0;
+		}
+		sock_clients[c->sock] = c;
+
+		// INIT -> CONNECTING
+		tsclog_4(me->log, me->index, j, transaction_count - c->txn_remaining, CONNECT_START);
+		add_connect(c->sock, server->ai_addr, server->ai_addrlen, up_connected);
+		c->state = CONNECTING;
+		return 0;
+
+	case READY:
+		/*
+		 * The specified client is ready to send a request, up_sent()
+		 * waits for the echo.
+		 *
+		 * Valid state transitions from here are: SENT
+		 */
+		tsclog_4(me->log, me->index, j, transaction_count - c->txn_remaining, SEND_START);
+		iov.iov_base = c->buf;
+		iov.iov_len  = c->buf_size;
+		ret = add_writev(c->sock, &iov, 1, up_sent);
+		if (ret) {
+			up_fail("add_writev():", -ret);
+			return 0;
+		}
+
+		c->state = SENT;
+		return 0;
+
+	case SENT:
+		/*
+		 * The specified client has received part of a response.
+		 *
+		 * Valid state transitions from here are: INIT, READY, SENT, DONE
+		 */
+		if (c->cursor < c->buf_size) {
+			// SENT -> SENT
+			add_read(c->sock, up_received);
+			return 0;
+		}
+
+		c->cursor = 0;
+		c->txn_remaining--;
+		if (c->txn_remaining == 0) {
+			// SENT -> DONE
+			c->state = DONE;
+			return 1 + up_state_transition(me, j);
+		}
+
+		c->batch_remaining--;
+		if (c->batch_remaining == 0) {
+			// SENT -> INIT
+			sock_clients[c->sock] = NULL;
+			add_close(c->sock, NULL);
+			c->state = INIT;
+			return 1 + up_state_transition(me, j);
+		}
+
+		// SENT -> READY
+		c->state = READY;
+		return 1 + up_state_transition(me, j);
+
+	case DONE:
+		/*
+		 * The specified client is done and needs to be cleaned up.
+		 *
+		 * There are no valid state transitions from here.
+		 */
+		sock_clients[c->sock] = NULL;
+		add_shutdown(c->sock, SHUT_RDWR, NULL);
+		add_close(c->sock, NULL);
+		c->sock = -1;
+		return 0;
+
+	default:
+		fprintf(stderr, "Invalid client state %d.\n", c->state);
+		set_dying();
+		return 0;
+	}
+}
+
+static void up_setup(int worker_id, int nr_workers)
+{
+	up_me = &threads[worker_id];
+	up_me->index = worker_id;
+	up_me->epoll_fd = -1;
+	worker_init(up_me);
+}
+
+/* Posted to every worker once they are all released */
+static void up_start(void *arg)
+{
+	size_t i;
+
+	for (i = 0; i < clients_per_thread; i++)
+		up_complete += up_state_transition(up_me, i);
+
+	add_timer(&up_watchdog, UPCALL_TICK_US, up_tick, NULL);
+	up_check_done();
+}
+
+/*
+ * Run the experiment on libupcall workers pinned to the first nr_threads
+ * CPUs and return once every worker has finished or one has died.
+ */
+static void upcall_run(void)
+{
+	struct rlimit rl;
+	cpu_set_t allowed, cpus;
+	size_t bufs;
+	size_t i;
+	int cpu, ret;
+
+	// Clients connect through the upcall, which not every backend carries
+	if (!upcall_backend_has(UP_CONNECT)) {
+		fprintf(stderr, "--upcall needs UP_CONNECT, which the %s backend "
+			"lacks; run with UPCALL_BACKEND=epoll\n",
+			upcall_backend_name());
+		exit(1);
+	}
+
+	max_sock = 65536;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		max_sock = rl.rlim_cur;
+	sock_clients = calloc(max_sock, sizeof(struct client *));
+	if (!sock_clients) {
+		perror("OOM");
+		exit(1);
+	}
+
+	// One worker on each of the first nr_threads CPUs we may run on
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		perror("sched_getaffinity():");
+		exit(1);
+	}
+	CPU_ZERO(&cpus);
+	for (cpu = 0, i = 0; cpu < CPU_SETSIZE && i < nr_threads; cpu++) {
+		if (CPU_ISSET(cpu, &allowed)) {
+			CPU_SET(cpu, &cpus);
+			i++;
+		}
+	}
+
+	// Every client has at most one receive outstanding
+	bufs = clients_per_thread < 64 ? 64 : clients_per_thread;
+	ret = upcall_init_cpus(&cpus, bufs, msg_size < 8 ? 8 : msg_size,
+			       up_setup, NULL);
+	if (ret) {
+		fprintf(stderr, "upcall_init failed on the %s backend: %s\n",
+			upcall_backend_name(), strerror(-ret));
+		exit(1);
+	}
+	nr_threads = upcall_nr_workers();
+
+	upcall_workers_go();
+	for (i = 0; i < nr_threads; i++) {
+		ret = upcall_post(i, up_start, NULL);
+		if (ret) {
+			fprintf(stderr, "upcall_post failed: %s\n", strerror(-ret));
+			exit(1);
+		}
+	}
+
+	pthread_mutex_lock(&init_lock);
+	while (workers_done < nr_threads)
+		pthread_cond_wait(&init_cond, &init_lock);
+	pthread_mutex_unlock(&init_lock);
+
+	upcall_fini(0, NULL);
+}
+#endif
+
 static void do_error_report(char *host)
 {
 	struct addrinfo *err_server;
@@ -624,7 +1007,7 @@ int main(int argc, char **argv)
 	uint64_t perf_sz = 0;
 	char *perf_buf;
 
-	char opt_str[] = "hp:m:c:b:t:T:o:s:S:";
+	char opt_str[] = "hp:m:c:b:t:T:o:s:S:u";
 	struct option long_opts[] = {
 		{"help",		no_argument,       NULL, 'h'},
 		{"port",		required_argument, NULL, 'p'},
@@ -636,6 +1019,7 @@ int main(int argc, char **argv)
 		{"thread-count",	required_argument, NULL, 'T'},
 		{"output",		required_argument, NULL, 'o'},
 		{"perf-stats",		required_argument, NULL, 'S'},
+		{"upcall",		no_argument,       NULL, 'u'},
 		{0}
 	};
 
@@ -691,6 +1075,15 @@ int main(int argc, char **argv)
 			stat_file = optarg;
 			break;
 
+		case 'u':
+#ifdef ENABLE_LIBUPCALL
+			use_upcall = 1;
+			break;
+#else
+			fprintf(stderr, "tcp_client was built without libupcall.\n");
+			return -1;
+#endif
+
 		default:
 			usage();
 			return -1;
@@ -783,6 +1176,13 @@ int main(int argc, char **argv)
 
 	threads = calloc(nr_threads, sizeof(struct worker));
 
+#ifdef ENABLE_LIBUPCALL
+	if (use_upcall) {
+		upcall_run();
+		goto finished;
+	}
+#endif
+
 	// Start threads
 	pthread_mutex_lock(&worker_hang_lock);
 	worker_cpu = CPU_ALLOC(nr_cpus);
@@ -819,6 +1219,9 @@ int main(int argc, char **argv)
 		pthread_join(threads[i].id, NULL);
 	}
 
+#ifdef ENABLE_LIBUPCALL
+finished:
+#endif
 	for (i = 0; i < nr_threads; i++) {
 		if (threads[i].dying) {
 			fprintf(stderr, "Worker threads failed, skipping stats output.\n");
@@ -47,6 +47,10 @@ static void usage(void)
 	OPTION("--port,-p [port]", "Use the requested port instead of 7272");
 	OPTION("--msg-size,-m [size]", "Use the requested message size instead of 32");
 	OPTION("--stats-port,-s [port]", "Listen on this port instead of 8383 for stats connections");
+	OPTION("--cpus,-c [list]", "Only run workers on these CPUs, e.g. 0-3,8");
+	CONT("Default is every CPU in our affinity mask");
+	OPTION("--batch,-b", "Hand read completions to their handler in batches");
+	CONT("upcall event system only, for comparison with per-event dispatch");
 }
 
 struct worker_thread **threads;
@@ -63,8 +67,20 @@ struct connection **conns;
 
 size_t msg_size;
 
+/* --batch: event systems that can batch their dispatch should */
+int batch_dispatch;
+
 size_t nr_cpus;
 
+/*
+ * The CPUs that get a worker: our affinity mask, which only holds online
+ * CPUs, narrowed by --cpus.  Worker i is pinned to worker_cpus[i] and
+ * cpu_workers[] maps a CPU back to its worker, or to -1 if it has none.
+ */
+cpu_set_t worker_set;
+int *worker_cpus;
+int cpu_workers[CPU_SETSIZE];
+
 __thread struct worker_thread *me;
 
 int max_fd;
@@ -129,6 +145,82 @@ void cache_free(struct buffer_cache *cache, void *buff, int cpu)
 	cache->tail = entry;
 }
 
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	for (;;) {
+		lo = hi = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		p = end;
+		if (*p == '-') {
+			hi = strtol(p + 1, &end, 10);
+			if (end == p + 1)
+				return -1;
+			p = end;
+		}
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+			return -1;
+		for (long cpu = lo; cpu <= hi; cpu++)
+			CPU_SET(cpu, set);
+		if (*p == '\0')
+			return 0;
+		if (*p != ',')
+			return -1;
+		p++;
+	}
+}
+
+static void init_cpu_map(const char *list)
+{
+	cpu_set_t wanted;
+	size_t i = 0;
+
+	if (sched_getaffinity(0, sizeof(worker_set), &worker_set)) {
+		perror("sched_getaffinity():");
+		exit(1);
+	}
+
+	if (list) {
+		if (parse_cpu_list(list, &wanted)) {
+			fprintf(stderr, "Invalid CPU list '%s'\n", list);
+			exit(1);
+		}
+		CPU_AND(&worker_set, &worker_set, &wanted);
+	}
+
+	nr_cpus = CPU_COUNT(&worker_set);
+	if (!nr_cpus) {
+		fprintf(stderr, "No usable CPUs to run workers on\n");
+		exit(1);
+	}
+
+	worker_cpus = calloc(nr_cpus, sizeof(int));
+	if (!worker_cpus) {
+		perror("calloc():");
+		exit(1);
+	}
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		cpu_workers[cpu] = -1;
+		if (CPU_ISSET(cpu, &worker_set)) {
+			worker_cpus[i] = cpu;
+			cpu_workers[cpu] = i++;
+		}
+	}
+}
+
+struct worker_thread *cpu_owner(int cpu)
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE || cpu_workers[cpu] < 0)
+		return me;
+	return threads[cpu_workers[cpu]];
+}
+
 static void init_conns(void)
 {
 	struct rlimit rl;
@@ -171,6 +263,7 @@ void write_perf_stats(void)
 	uint64_t perf_values[TOTAL_EVENTS] = {0};
 	struct read_format perf_stats;
 	struct worker_thread *t;
+	char engine_line[ENGINE_STATS_SZ];
 	
 	for (size_t i = 0; i < nr_cpus; i++)
 		ioctl(threads[i]->perf_fds[0], PERF_EVENT_IOC_DISABLE, 0);
@@ -191,10 +284,13 @@ void write_perf_stats(void)
 			}
 		}
 
+		engine_stats(t->index, engine_line, sizeof(engine_line));
+
 		// We use TOTAL_EVENTS + 2 because we emit two per thread counters here as well (accept and connection count)
-		snprintf(t->perf_line, 23 + 21 * (TOTAL_EVENTS + 2), "%d\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n",
-				t->index, perf_values[0], perf_values[1], perf_values[2],
-				perf_values[3], perf_values[4], t->accept_count, t->conn_count);
+		snprintf(t->perf_line, sizeof(t->perf_line), "%d\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu%s\n",
+				t->cpu, perf_values[0], perf_values[1], perf_values[2],
+				perf_values[3], perf_values[4], t->accept_count, t->conn_count,
+				engine_line);
 	}
 }
 
@@ -249,7 +345,7 @@ void setup_perf(int *fds, int *ids, int cpu)
 
 void on_stats(int stats_fd, int epoll_fd)
 {
-	char header[] = "CPU\tCYCLES\tINSTRUCTIONS\tCACHE_READS\tCACHE_MISSES\tICACHE_MISSES\tACCEPT_COUNT\tCONNECTION_COUNT\n";
+	char header[128 + ENGINE_STATS_SZ];
 	uint64_t size = 0;
 	size_t cursor = 0;
 	struct epoll_event evt;
@@ -269,6 +365,9 @@ void on_stats(int stats_fd, int epoll_fd)
 
 	init_count = 0;
 
+	snprintf(header, sizeof(header), "CPU\tCYCLES\tINSTRUCTIONS\tCACHE_READS\tCACHE_MISSES\tICACHE_MISSES\tACCEPT_COUNT\tCONNECTION_COUNT%s\n",
+			engine_stats_header());
+
 	write_perf_stats();
 
 	size = strlen(header);
@@ -388,13 +487,17 @@ int main(int argc, char **argv)
 	struct addrinfo *statsaddr, *erroraddr;
 	struct epoll_event evt;
 
-	char opt_str[] = "hp:m:s:e:";
+	char *cpu_list = NULL;
+
+	char opt_str[] = "hp:m:s:e:c:b";
 	struct option long_opts[] = {
 		{"help",	no_argument, NULL, 'h'},
 		{"port",	required_argument, NULL, 'p'},
 		{"msg-size",	required_argument, NULL, 'm'},
 		{"stats-port",	required_argument, NULL, 's'},
 		{"error-port",	required_argument, NULL, 'e'},
+		{"cpus",	required_argument, NULL, 'c'},
+		{"batch",	no_argument, NULL, 'b'},
 		{0}
 	};
 
@@ -426,6 +529,14 @@ int main(int argc, char **argv)
 			error = strtol(optarg, NULL, 10);
 			break;
 
+		case 'c':
+			cpu_list = optarg;
+			break;
+
+		case 'b':
+			batch_dispatch = 1;
+			break;
+
 		default:
 			usage();
 			return -1;
@@ -527,7 +638,7 @@ int main(int argc, char **argv)
 
 	init_conns();
 
-	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	init_cpu_map(cpu_list);
 	threads = calloc(nr_cpus, sizeof(struct worker_thread *));
 	if (!threads) {
 		perror("calloc():");
@@ -28,6 +28,7 @@ struct transaction {
 struct connection {
 	uint64_t cursor;
 	uint8_t *buffer;
+	uint8_t *pool_buf;	// libupcall buffer being echoed without a copy
 	struct TscLog *accept_log;
 	struct TscLog *work_log;
 	uint64_t event_count;
@@ -48,18 +49,22 @@ struct conn_queue {
 	struct waiting_conn *list;
 };
 
+/* Room for the columns an event system adds with engine_stats() */
+#define ENGINE_STATS_SZ 512
+
 struct worker_thread {
 	pthread_t thread_id;
 	struct conn_queue incoming;
 	int event_fd;
 	int epoll_fd;
 	int listen_sock;
-	int index;
+	int index;	// Worker id
+	int cpu;	// CPU the worker is pinned to, labels its stats row
 	int perf_fds[TOTAL_EVENTS];
 	int perf_ids[TOTAL_EVENTS];
 	size_t accept_count;	// The number of accepts this thread handled
 	size_t conn_count;	// The number of connections this thread handled (post accept)
-	char perf_line[23 + 21 * (TOTAL_EVENTS + 2)]; // We use TOTAL_EVENTS + 2 for the previous counters
+	char perf_line[23 + 21 * (TOTAL_EVENTS + 2) + ENGINE_STATS_SZ]; // We use TOTAL_EVENTS + 2 for the previous counters
 	struct transaction *log_head;
 };
 
@@ -95,9 +100,25 @@ void on_read(void *arg);
 
 void setup_perf(int *fds, int *ids, int cpu);
 
+/*
+ * Worker that owns connections arriving on cpu (SO_INCOMING_CPU), or the
+ * calling worker when no worker runs on that CPU.
+ */
+struct worker_thread *cpu_owner(int cpu);
+
 void init_threads(uint64_t nr_cpus);
 void workers_go(void);
 
+/*
+ * Extra per-worker columns for the stats report.  engine_stats_header()
+ * returns the column names and engine_stats() writes the values of the
+ * worker with index worker_id (its struct worker_thread's index, not a
+ * CPU number), each column preceded by a tab.  Event systems with nothing
+ * to add return "" and write an empty string.
+ */
+const char *engine_stats_header(void);
+void engine_stats(int worker_id, char *buf, size_t len);
+
 struct connection *new_conn(int fd);
 
 void on_close(void *arg);
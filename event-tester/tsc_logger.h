@@ -89,7 +89,7 @@ static inline void * tsc_buffer_reserve(uint32_t bytes, void * volatile *cur, vo
 {
 	uint8_t *old, *fresh;
 retry:
-	old = *cur;
+	old = (uint8_t *)*cur;
 	fresh = old + bytes;
 	if ((uint64_t)fresh > (uint64_t)end)
 		return NULL;
@@ -108,7 +108,7 @@ static inline struct TscLogEntry *
 tsclog_getentry(struct TscLog *lptr, uint32_t numvals)
 {
 	struct TscLogEntry *e;
-	e = tsc_buffer_reserve(TscLogEntrySize(numvals), &(lptr->hdr.info.cur),
+	e = (struct TscLogEntry *)tsc_buffer_reserve(TscLogEntrySize(numvals), &(lptr->hdr.info.cur),
 				lptr->hdr.info.end);
 	if (e == NULL)
 		lptr->hdr.info.overflow = 1;
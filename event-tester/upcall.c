@@ -12,44 +12,37 @@
 #include <errno.h>
 #include <pthread.h>
 
-#include <sys/ioctl.h>
-
-#include <linux/perf_event.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
 #include "tcp_echo.h"
+#include "upcall_common.h"
 #include "../libupcall/upcall.h"
 
 extern __thread struct worker_thread *me;
 extern __thread struct buffer_cache *msg_cache;
 extern __thread struct buffer_cache *conn_cache;
 extern struct connection **conns;
-extern struct worker_thread **threads;
-extern size_t nr_cpus;
 extern size_t msg_size;
-extern struct addrinfo *res;
+extern int batch_dispatch;
 
 struct connection *new_conn(int fd);
 
 void my_read(struct up_event *arg);
 
-void my_accept(struct up_event *arg)
+/*
+ * Take ownership of a freshly accepted socket on the calling worker.
+ */
+static void start_conn(void *arg)
 {
-	int incoming = arg->result;
+	int incoming = (intptr_t)arg;
 	struct connection *new;
 
-	if (incoming < 0) {
-		printf("Error on accept %d\n", incoming);
-		goto out;
-	}
-
-	me->accept_count++;
-
 	new = new_conn(incoming);
 	if (!new)
 		exit(1);
 
+	/* Only for the error port's dump, callbacks get conn from user_data */
 	conns[incoming] = new;
 	new->state = WAITING;
 
@@ -61,14 +54,51 @@ void my_accept(struct up_event *arg)
 		}
 	}
 
-	add_read(new->fd, my_read);
+	/*
+	 * One read registration serves the whole connection.  tcp_client
+	 * waits for each echo before sending again, so data never arrives
+	 * while a write from conn->buffer is still in flight.
+	 */
+	add_read_multishot_data(new->fd, my_read, (uintptr_t)new);
+}
+
+void my_accept(struct up_event *arg)
+{
+	int incoming = arg->result;
+	socklen_t size = sizeof(int);
+	int cpu, owner;
+
+	if (incoming < 0) {
+		printf("Error on accept %d\n", incoming);
+		goto out;
+	}
+
+	me->accept_count++;
+
+	/*
+	 * SO_REUSEPORT spreads connections over the listeners without regard
+	 * for where their packets are processed.  Hand each one to the worker
+	 * on the CPU it arrives on so the echo runs there.
+	 */
+	owner = me->index;
+	if (!getsockopt(incoming, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size))
+		owner = upcall_cpu_worker(cpu);
+
+	if (owner < 0 || owner == me->index ||
+	    upcall_post(owner, start_conn, (void *)(intptr_t)incoming))
+		start_conn((void *)(intptr_t)incoming);
 out:
-	add_accept(arg->fd, my_accept);
+	if (arg->flags & UP_F_LAST)
+		add_accept_multishot(arg->fd, my_accept);
 }
 
 static void my_write(struct up_event *arg)
 {
-	struct connection *conn = conns[arg->fd];
+	struct connection *conn = (struct connection *)(uintptr_t)arg->user_data;
+
+	/* on_close() got here first and has already released everything */
+	if (arg->result == -ECANCELED)
+		return;
 
 	if (arg->result == 0) {
 		on_close(conn);
@@ -80,24 +110,35 @@ static void my_write(struct up_event *arg)
 		return;
 	}
 
-	if (arg->result + conn->cursor < msg_size) {
-		conn->cursor += arg->result;
-		add_write(conn->fd, (conn->buffer + conn->cursor),
-			  msg_size - conn->cursor, my_write);
-		return;
+	if (conn->pool_buf) {
+		upcall_buf_release(conn->pool_buf);
+		conn->pool_buf = NULL;
 	}
+}
 
-	conn->cursor = 0;
+/*
+ * libupcall finishes short writes itself, so my_write only ever sees the
+ * whole message go out.
+ */
+static void echo_msg(struct connection *conn, uint8_t *buf)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = msg_size };
+	int ret;
 
-	add_read(conn->fd, my_read);
+	ret = add_writev_data(conn->fd, &iov, 1, my_write, (uintptr_t)conn);
+	if (ret) {
+		fprintf(stderr, "add_writev failed %d\n", ret);
+		exit(1);
+	}
 }
 
 void my_read(struct up_event *arg)
 {
-	struct connection *conn = conns[arg->fd];
+	struct connection *conn = (struct connection *)(uintptr_t)arg->user_data;
 	uint8_t *buf = (uint8_t *)arg->buf;
 
-	if (conn->fd < 0)
+	/* A write error closed it, this is the read's last word and holds no data */
+	if (arg->result == -ECANCELED)
 		return;
 
 	if (arg->result == 0) {
@@ -112,117 +153,52 @@ void my_read(struct up_event *arg)
 		return;
 	}
 
+	// A whole message in one pool buffer is echoed straight from it
+	if (conn->cursor == 0 && arg->result == msg_size) {
+		conn->pool_buf = upcall_buf_retain(arg);
+		if (conn->pool_buf) {
+			echo_msg(conn, conn->pool_buf);
+			return;
+		}
+	}
+
 	memcpy(&(conn->buffer[conn->cursor]), buf, arg->result);
 	conn->cursor += arg->result;
 	return_buffer(buf, arg->len);
 
-	if (conn->cursor < msg_size) {
-		add_read(conn->fd, my_read);
+	if (conn->cursor < msg_size)
 		return;
-	}
 
 	conn->cursor = 0;
 
-	add_write(conn->fd, conn->buffer, msg_size, my_write);
+	echo_msg(conn, conn->buffer);
 }
 
 /*
- * Per-worker setup callback: called by libupcall from each worker thread
- * after pool initialisation.  Registers the worker's listen socket so
- * it is ready before upcall_workers_go() opens the event loop.
+ * --batch: the reads of a whole submit arrive together, which keeps
+ * my_read hot and lets the next connection's state load while the current
+ * one is echoed.  Writes finish inside libupcall's writev handler, so
+ * reads are the only completions worth grouping.
  */
-static void upcall_echo_setup(int worker_id, int nr_workers)
+static void my_read_batch(struct up_event *evts, int cnt)
 {
-	int i = 1;
-
-	me = calloc(1, sizeof(struct worker_thread));
-	if (!me) {
-		perror("calloc:");
-		exit(1);
-	}
-
-	me->index = worker_id;
-
-	msg_cache = init_cache(msg_size, 1024, me->index);
-	if (!msg_cache) {
-		perror("OOM");
-		exit(1);
-	}
-
-	conn_cache = init_cache(sizeof(struct connection), 1024, me->index);
-	if (!conn_cache) {
-		perror("OOM");
-		exit(1);
-	}
-
-	threads[worker_id] = me;
-
-	me->listen_sock = socket(res->ai_family,
-				 res->ai_socktype | SOCK_NONBLOCK,
-				 res->ai_protocol);
-	if (me->listen_sock < 0) {
-		perror("socket():");
-		exit(1);
-	}
-
-	if (setsockopt(me->listen_sock, SOL_SOCKET, SO_REUSEPORT, &i, sizeof(i))) {
-		perror("setsockopt SO_REUSEPORT:");
-		exit(1);
+	for (int i = 0; i < cnt; i++) {
+		if (i + 1 < cnt)
+			__builtin_prefetch((void *)(uintptr_t)evts[i + 1].user_data);
+		my_read(&evts[i]);
 	}
-
-	if (setsockopt(me->listen_sock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i))) {
-		perror("setsockopt SO_REUSEADDR:");
-		exit(1);
-	}
-
-	if (bind(me->listen_sock, res->ai_addr, res->ai_addrlen)) {
-		perror("bind():");
-		exit(1);
-	}
-
-	if (listen(me->listen_sock, BACKLOG)) {
-		perror("listen():");
-		exit(1);
-	}
-
-	add_accept(me->listen_sock, my_accept);
-
-	setup_perf(me->perf_fds, me->perf_ids, me->index);
-
-	ioctl(me->perf_fds[0], PERF_EVENT_IOC_RESET, 0);
-	ioctl(me->perf_fds[0], PERF_EVENT_IOC_ENABLE, 0);
 }
 
-void on_close(void *arg)
+/*
+ * Accept on the worker's listen socket, and with --batch take the reads
+ * of a whole submit at once.
+ */
+void upcall_engine_start(int listen_sock)
 {
-	int closed_fd;
-	struct connection *conn = (struct connection *)arg;
-
-	closed_fd = conn->fd;
-	conn->fd = -1;
+	add_accept_multishot(listen_sock, my_accept);
 
-	if (closed_fd >= 0) {
-		conns[closed_fd] = NULL;
-		conn->state = CLOSING;
-		close(closed_fd);
-
-		pthread_mutex_destroy(&conn->lock);
-
-		cache_free(msg_cache, conn->buffer, me->index);
-		cache_free(conn_cache, conn, me->index);
-		me->conn_count++;
-	}
-}
-
-void init_threads(uint64_t ignored)
-{
-	if (upcall_init(BUF_COUNT, msg_size, upcall_echo_setup, NULL)) {
-		fprintf(stderr, "upcall_init failed\n");
+	if (batch_dispatch && upcall_batch_handler(my_read, my_read_batch)) {
+		fprintf(stderr, "upcall_batch_handler failed\n");
 		exit(1);
 	}
 }
-
-void workers_go(void)
-{
-	upcall_workers_go();
-}
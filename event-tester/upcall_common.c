@@ -0,0 +1,180 @@
+/*
+ * The parts of the tcp_echo server that both libupcall implementations,
+ * upcall.c and upcall_coro.cpp, share.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/ioctl.h>
+
+#include <linux/perf_event.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "tcp_echo.h"
+#include "upcall_common.h"
+#include "../libupcall/upcall.h"
+
+extern __thread struct worker_thread *me;
+extern __thread struct buffer_cache *msg_cache;
+extern __thread struct buffer_cache *conn_cache;
+extern struct connection **conns;
+extern struct worker_thread **threads;
+extern cpu_set_t worker_set;
+extern size_t msg_size;
+extern struct addrinfo *res;
+
+/*
+ * Per-worker setup callback: called by libupcall from each worker thread
+ * after pool initialisation.  Opens the worker's listen socket and lets
+ * the engine register it, so it is ready before upcall_workers_go()
+ * opens the event loop.
+ */
+static void upcall_echo_setup(int worker_id, int nr_workers)
+{
+	int i = 1;
+
+	me = calloc(1, sizeof(struct worker_thread));
+	if (!me) {
+		perror("calloc:");
+		exit(1);
+	}
+
+	/*
+	 * libupcall numbers workers in topology order, not in tcp_echo's
+	 * ascending CPU order, so the stats row label comes from it
+	 */
+	me->index = worker_id;
+	me->cpu = upcall_worker_cpu(worker_id);
+
+	msg_cache = init_cache(msg_size, 1024, me->index);
+	if (!msg_cache) {
+		perror("OOM");
+		exit(1);
+	}
+
+	conn_cache = init_cache(sizeof(struct connection), 1024, me->index);
+	if (!conn_cache) {
+		perror("OOM");
+		exit(1);
+	}
+
+	threads[worker_id] = me;
+
+	me->listen_sock = socket(res->ai_family,
+				 res->ai_socktype | SOCK_NONBLOCK,
+				 res->ai_protocol);
+	if (me->listen_sock < 0) {
+		perror("socket():");
+		exit(1);
+	}
+
+	if (setsockopt(me->listen_sock, SOL_SOCKET, SO_REUSEPORT, &i, sizeof(i))) {
+		perror("setsockopt SO_REUSEPORT:");
+		exit(1);
+	}
+
+	if (setsockopt(me->listen_sock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i))) {
+		perror("setsockopt SO_REUSEADDR:");
+		exit(1);
+	}
+
+	if (bind(me->listen_sock, res->ai_addr, res->ai_addrlen)) {
+		perror("bind():");
+		exit(1);
+	}
+
+	if (listen(me->listen_sock, BACKLOG)) {
+		perror("listen():");
+		exit(1);
+	}
+
+	upcall_engine_start(me->listen_sock);
+
+	setup_perf(me->perf_fds, me->perf_ids, me->cpu);
+
+	ioctl(me->perf_fds[0], PERF_EVENT_IOC_RESET, 0);
+	ioctl(me->perf_fds[0], PERF_EVENT_IOC_ENABLE, 0);
+}
+
+void on_close(void *arg)
+{
+	int closed_fd;
+	struct connection *conn = (struct connection *)arg;
+
+	closed_fd = conn->fd;
+	conn->fd = -1;
+
+	if (closed_fd >= 0) {
+		conns[closed_fd] = NULL;
+		conn->state = CLOSING;
+		add_close(closed_fd, NULL);
+
+		pthread_mutex_destroy(&conn->lock);
+
+		if (conn->pool_buf) {
+			upcall_buf_release(conn->pool_buf);
+			conn->pool_buf = NULL;
+		}
+
+		cache_free(msg_cache, conn->buffer, me->index);
+		cache_free(conn_cache, conn, me->index);
+		me->conn_count++;
+	}
+}
+
+void init_threads(uint64_t ignored)
+{
+	int ret;
+
+	ret = upcall_init_cpus(&worker_set, BUF_COUNT, msg_size,
+			       upcall_echo_setup, NULL);
+	if (ret) {
+		fprintf(stderr, "upcall_init failed on the %s backend: %s\n",
+			upcall_backend_name(), strerror(-ret));
+		exit(1);
+	}
+}
+
+void workers_go(void)
+{
+	upcall_workers_go();
+}
+
+const char *engine_stats_header(void)
+{
+	return "\tSUBMITS\tCOMPLETIONS\tBATCH_0\tBATCH_1\tBATCH_2_3\tBATCH_4_7"
+	       "\tBATCH_8_15\tBATCH_16_31\tBATCH_32_63\tBATCH_64+\tWORK_HWM"
+	       "\tWORK_REALLOCS\tPOOL_DEPTH\tPOOL_UNDERFLOWS\tPOOL_STALLS"
+	       "\tCALLBACK_CYCLES\tSUBMIT_CYCLES\tSPINS\tSPIN_HITS\tSLEEPS"
+	       "\tSPIN_CYCLES\tBATCHES\tBATCHED\tDEFERRALS";
+}
+
+void engine_stats(int worker_id, char *buf, size_t len)
+{
+	struct upcall_stats st;
+	int off;
+
+	buf[0] = '\0';
+	if (upcall_stats(worker_id, &st))
+		return;
+
+	off = snprintf(buf, len, "\t%lu\t%lu", st.submits, st.completions);
+	for (int i = 0; i < UPCALL_STATS_BATCH_BUCKETS && (size_t)off < len; i++)
+		off += snprintf(&buf[off], len - off, "\t%lu", st.batch_hist[i]);
+	if ((size_t)off < len)
+		snprintf(&buf[off], len - off,
+			 "\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu"
+			 "\t%lu\t%lu\t%lu",
+			 st.work_hwm, st.work_reallocs, st.pool_depth,
+			 st.pool_underflows, st.pool_stalls, st.callback_cycles,
+			 st.submit_cycles, st.spins, st.spin_hits, st.sleeps,
+			 st.spin_cycles, st.batches, st.batched, st.deferrals);
+}
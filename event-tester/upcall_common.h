@@ -0,0 +1,17 @@
+/*
+ * What the two libupcall implementations of the tcp_echo server, upcall.c
+ * and upcall_coro.cpp, share.  upcall_common.c sets up each worker, closes
+ * connections and reports libupcall's stats; the engine only starts
+ * accepting on the worker's listen socket.
+ */
+
+#ifndef _UPCALL_COMMON_H_
+#define _UPCALL_COMMON_H_
+
+/*
+ * Called on each worker from libupcall's setup_fn, once me and the
+ * worker's listen socket are ready and before the event loop opens.
+ */
+void upcall_engine_start(int listen_sock);
+
+#endif
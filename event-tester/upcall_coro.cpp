@@ -0,0 +1,142 @@
+/*
+ * This is the upcall implementation of the tcp_echo server written with the
+ * C++20 coroutine front end.  It does the same work as upcall.c, one
+ * coroutine per connection in place of the read/write callbacks, so the
+ * two can be compared directly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+extern "C" {
+#include "tcp_echo.h"
+#include "upcall_common.h"
+}
+#include "../libupcall/upcall_coro.hpp"
+
+extern __thread struct worker_thread *me;
+extern __thread struct buffer_cache *msg_cache;
+extern __thread struct buffer_cache *conn_cache;
+extern struct connection **conns;
+extern size_t msg_size;
+
+/*
+ * Whole messages that arrive in one pool buffer are echoed straight from
+ * it, anything else is gathered in conn->buffer first, as in upcall.c.
+ * One multishot read registration serves the whole connection, as there.
+ */
+static upcall::task echo_conn(struct connection *conn)
+{
+	upcall::io up;
+	upcall::reader rd(conn->fd);
+	struct up_event evt;
+	uint8_t *out;
+
+	for (;;) {
+		evt = co_await rd.read();
+		if (evt.result == -ENOMEM)
+			continue;
+		if (evt.result <= 0) {
+			if (evt.result < 0)
+				printf("Error on read %d\n", evt.result);
+			break;
+		}
+
+		conn->event_count++;
+
+		out = NULL;
+		if (conn->cursor == 0 && evt.result == (int32_t)msg_size)
+			out = conn->pool_buf = (uint8_t *)upcall_buf_retain(&evt);
+
+		if (!out) {
+			memcpy(&conn->buffer[conn->cursor], evt.buf, evt.result);
+			conn->cursor += evt.result;
+			return_buffer(evt.buf, evt.len);
+			if (conn->cursor < msg_size)
+				continue;
+			conn->cursor = 0;
+			out = conn->buffer;
+		}
+
+		evt = co_await up.write(conn->fd, out, msg_size);
+		if (conn->pool_buf) {
+			upcall_buf_release(conn->pool_buf);
+			conn->pool_buf = NULL;
+		}
+		if (evt.result <= 0) {
+			if (evt.result < 0)
+				printf("Error on write %d\n", evt.result);
+			co_await rd.cancel();
+			break;
+		}
+	}
+
+	on_close(conn);
+}
+
+/*
+ * Take ownership of a freshly accepted socket on the calling worker.
+ */
+static void start_conn(void *arg)
+{
+	int incoming = (intptr_t)arg;
+	struct connection *conn;
+
+	conn = new_conn(incoming);
+	if (!conn)
+		exit(1);
+
+	conns[incoming] = conn;
+	conn->state = WAITING;
+
+	if (!conn->buffer) {
+		conn->buffer = (uint8_t *)cache_alloc(msg_cache, me->index);
+		if (!conn->buffer) {
+			perror("Malloc on accept");
+			exit(1);
+		}
+	}
+
+	echo_conn(conn);
+}
+
+static upcall::task accept_loop(int listen_sock)
+{
+	upcall::io up;
+	struct up_event evt;
+	socklen_t size;
+	int cpu, owner;
+
+	for (;;) {
+		evt = co_await up.accept(listen_sock);
+		if (evt.result < 0) {
+			printf("Error on accept %d\n", evt.result);
+			continue;
+		}
+
+		me->accept_count++;
+
+		/* Hand the connection to the worker on its CPU, see upcall.c */
+		owner = me->index;
+		size  = sizeof(int);
+		if (!getsockopt(evt.result, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size))
+			owner = upcall_cpu_worker(cpu);
+
+		if (owner < 0 || owner == me->index ||
+		    upcall_post(owner, start_conn, (void *)(intptr_t)evt.result))
+			start_conn((void *)(intptr_t)evt.result);
+	}
+}
+
+extern "C" void upcall_engine_start(int listen_sock)
+{
+	accept_loop(listen_sock);
+}
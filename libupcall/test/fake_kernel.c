@@ -0,0 +1,182 @@
+/**
+ * Upcall support library - a stand-in for the upcall syscalls
+ * Copyright (C) 2024 Eric B Munson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Linked with -Wl,--wrap=syscall,--wrap=close,--wrap=munmap so the kernel
+ * backend can be tested without an upcall kernel.  Syscalls 468 and 469
+ * go to the epoll emulation, through the original 40 byte event.  Like
+ * the real kernel, the stand-in keeps writing into the buffers it was
+ * given with UP_VEC until their upfd is closed, so unmapping one of those
+ * before then is counted in fake_kernel_violations.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "../upcall_int.h"
+
+struct fake_kevent {
+	int32_t		fd;
+	int32_t		result;
+	void		*buf;
+	uint64_t	len;
+	uint64_t	cookie;
+	uint64_t	type;
+} __attribute__((packed));
+
+#define FAKE_UPFDS	16
+#define FAKE_BUFS	65536
+
+/* Every buffer an open upfd holds, by the upfd */
+static struct {
+	int	upfd;
+	void	*buf;
+} held[FAKE_BUFS];
+static int nr_held;
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int fake_kernel_violations;
+
+long __real_syscall(long nr, ...);
+int __real_close(int fd);
+int __real_munmap(void *addr, size_t len);
+
+static void hold(int upfd, void *buf)
+{
+	if (nr_held < FAKE_BUFS) {
+		held[nr_held].upfd = upfd;
+		held[nr_held].buf  = buf;
+		nr_held++;
+	}
+}
+
+static void unhold(int upfd, void *buf)
+{
+	for (int i = 0; i < nr_held; i++) {
+		if (held[i].upfd == upfd && held[i].buf == buf) {
+			held[i] = held[--nr_held];
+			return;
+		}
+	}
+}
+
+static long fake_submit(int upfd, int in_cnt, struct fake_kevent *kin,
+			int out_cnt, struct fake_kevent *kout, long flags)
+{
+	struct up_event in[in_cnt + 1], out[out_cnt + 1];
+	int ret;
+
+	memset(in, 0, sizeof(in));
+	pthread_mutex_lock(&held_lock);
+	for (int i = 0; i < in_cnt; i++) {
+		in[i].fd      = kin[i].fd;
+		in[i].buf     = kin[i].buf;
+		in[i].len     = kin[i].len;
+		in[i].type    = (int)kin[i].type;
+		in[i].work_fn = (void (*)(struct up_event *))(uintptr_t)kin[i].cookie;
+		if (in[i].type == UP_VEC) {
+			struct iovec *iov = in[i].buf;
+
+			for (uint64_t j = 0; j < in[i].len; j++)
+				hold(upfd, iov[j].iov_base);
+		}
+	}
+	pthread_mutex_unlock(&held_lock);
+
+	if (flags & UPCALL_SUBMIT_NOWAIT)
+		ret = upcall_epoll_backend.submit_nowait(upfd, in_cnt, in,
+							 out_cnt, out);
+	else
+		ret = upcall_epoll_backend.submit(upfd, in_cnt, in, out_cnt, out);
+
+	pthread_mutex_lock(&held_lock);
+	for (int i = 0; i < ret; i++) {
+		kout[i].fd     = out[i].fd;
+		kout[i].result = out[i].result;
+		kout[i].buf    = out[i].buf;
+		kout[i].len    = out[i].len;
+		kout[i].type   = out[i].type;
+		kout[i].cookie = (uintptr_t)out[i].work_fn;
+		if (out[i].type == UP_READ && out[i].buf)
+			unhold(upfd, out[i].buf);
+	}
+	pthread_mutex_unlock(&held_lock);
+	return ret;
+}
+
+long __wrap_syscall(long nr, ...)
+{
+	va_list ap;
+	long a[6];
+
+	va_start(ap, nr);
+	for (int i = 0; i < 6; i++)
+		a[i] = va_arg(ap, long);
+	va_end(ap);
+
+	if (nr == 468)
+		return upcall_epoll_backend.create(a[0]);
+	if (nr == 469)
+		return fake_submit(a[0], a[1], (struct fake_kevent *)a[2], a[3],
+				   (struct fake_kevent *)a[4], a[5]);
+	return __real_syscall(nr, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+int __wrap_close(int fd)
+{
+	pthread_mutex_lock(&held_lock);
+	for (int i = 0; i < nr_held; ) {
+		if (held[i].upfd == fd)
+			held[i] = held[--nr_held];
+		else
+			i++;
+	}
+	pthread_mutex_unlock(&held_lock);
+	return __real_close(fd);
+}
+
+int __wrap_munmap(void *addr, size_t len)
+{
+	pthread_mutex_lock(&held_lock);
+	for (int i = 0; i < nr_held; i++) {
+		if ((char *)held[i].buf >= (char *)addr &&
+		    (char *)held[i].buf < (char *)addr + len) {
+			fake_kernel_violations++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&held_lock);
+	return __real_munmap(addr, len);
+}
+
+/* Buffers still held by the open upfds */
+int fake_kernel_held(void)
+{
+	int nr;
+
+	pthread_mutex_lock(&held_lock);
+	nr = nr_held;
+	pthread_mutex_unlock(&held_lock);
+	return nr;
+}
@@ -0,0 +1,96 @@
+/**
+ * Upcall support library - upcall_fini() with reads outstanding
+ * Copyright (C) 2024 Eric B Munson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Run with UPCALL_BACKEND=kernel on top of fake_kernel.c.  Every worker
+ * leaves a read on a quiet socket outstanding, then the pool is shut down:
+ * none of the buffers the upfd still holds may be unmapped before the
+ * upfd itself is closed.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../upcall.h"
+
+#define MAX_WORKERS	1024
+
+extern int fake_kernel_violations;
+int fake_kernel_held(void);
+
+static int socks[MAX_WORKERS][2];
+
+static void on_read(struct up_event *evt)
+{
+	if (evt->result > 0)
+		return_buffer(evt->buf, evt->len);
+}
+
+static void setup(int worker_id, int nr_workers)
+{
+	if (worker_id >= MAX_WORKERS)
+		return;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, socks[worker_id])) {
+		perror("socketpair");
+		exit(1);
+	}
+	add_read_multishot(socks[worker_id][0], on_read);
+}
+
+int main(void)
+{
+	int nr, ret;
+
+	ret = upcall_init(64, 4096, setup, NULL);
+	if (ret) {
+		fprintf(stderr, "upcall_init: %d\n", ret);
+		return 1;
+	}
+	upcall_workers_go();
+	nr = upcall_nr_workers();
+
+	/* Let every worker submit its read */
+	usleep(50 * 1000);
+	if (!fake_kernel_held()) {
+		fprintf(stderr, "FAIL: no buffers outstanding\n");
+		return 1;
+	}
+
+	ret = upcall_fini(0, NULL);
+	if (ret) {
+		fprintf(stderr, "upcall_fini: %d\n", ret);
+		return 1;
+	}
+	for (int i = 0; i < nr && i < MAX_WORKERS; i++) {
+		close(socks[i][0]);
+		close(socks[i][1]);
+	}
+
+	if (fake_kernel_violations) {
+		fprintf(stderr, "FAIL: %d arenas unmapped under an open upfd\n",
+			fake_kernel_violations);
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
@@ -20,7 +20,11 @@
 #define _GNU_SOURCE
 
 #include <sys/syscall.h>
-#include <sys/sysinfo.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stddef.h>
@@ -34,6 +38,16 @@
 #include <errno.h>
 
 #include "upcall.h"
+#include "upcall_int.h"
+
+#ifdef UPCALL_TRACE
+#if !defined(__x86_64__)
+#error "UPCALL_TRACE needs the x86-64 TSC logger"
+#endif
+#define UKL_USER
+#include "../event-tester/tsc_logger.h"
+#undef UKL_USER
+#endif
 
 #ifndef SYS_upcall_create
 #define SYS_upcall_create 468
@@ -43,21 +57,425 @@
 #define SYS_upcall_submit 469
 #endif
 
+#ifndef UPCALL_DEFAULT_BACKEND
+#define UPCALL_DEFAULT_BACKEND "kernel"
+#endif
+
 #define EVTS 4
 
+#define HUGE_PAGE_SZ	(2UL << 20)
+#define BASE_PAGE_SZ	4096UL
+#define CACHE_LINE_SZ	64UL
+
+/* Slots in each worker's upcall_post() ring, must be a power of two */
+#ifndef UPCALL_POST_RING
+#define UPCALL_POST_RING 1024
+#endif
+
+/* Slots in each worker's upcall_spawn() deque, must be a power of two */
+#ifndef UPCALL_TASK_DEQUE
+#define UPCALL_TASK_DEQUE 1024
+#endif
+
+/* How long a worker runs its own tasks before it checks on its I/O */
+#ifndef UPCALL_TASK_SLICE_US
+#define UPCALL_TASK_SLICE_US 50
+#endif
+
+/*
+ * Pool watermarks, in percent of a class's count.  Below the low mark the
+ * backend is topped back up to count from the class's reserve, which is
+ * UPCALL_POOL_RESERVE percent of count; above the high mark the surplus
+ * goes back into the reserve.
+ */
+#ifndef UPCALL_POOL_LOW
+#define UPCALL_POOL_LOW 75
+#endif
+
+#ifndef UPCALL_POOL_HIGH
+#define UPCALL_POOL_HIGH 125
+#endif
+
+#ifndef UPCALL_POOL_RESERVE
+#define UPCALL_POOL_RESERVE 100
+#endif
+
 /* ------------------------------------------------------------------ */
 /* Low-level syscall wrappers — private to this file                   */
 /* ------------------------------------------------------------------ */
 
-static int upcall_create(int flags)
+static int kernel_create(int flags)
 {
 	return syscall(SYS_upcall_create, flags);
 }
 
-static int upcall_submit(int upfd, int in_cnt, struct up_event *in,
+/*
+ * The kernel's struct up_event: the 40 bytes of the original ABI, with
+ * neither flags nor user_data.  The kernel hands each action's work_fn
+ * back untouched with its completion, so the kernel backend puts a cookie
+ * there instead: one more than the index of the slot that keeps what the
+ * event has no room for until the completion comes back.  UP_VEC never
+ * completes and takes no slot.
+ */
+struct up_kevent {
+	int32_t		fd;
+	int32_t		result;
+	void		*buf;
+	uint64_t	len;
+	uint64_t	cookie;
+	union {
+		up_action_t	type;
+		uint64_t	pad;
+	};
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct up_kevent) == 40, "upcall ABI event size");
+
+/*
+ * Input actions are also kept on a list per fd, for kernel_cancel() to
+ * find them.
+ */
+struct kernel_slot {
+	void		(*work_fn)(struct up_event *arg);
+	uint64_t	user_data;
+	uint32_t	flags;
+	int		fd;
+	bool		input;
+	bool		cancelled;
+	int		next;		/* on the free list, or the fd's list */
+};
+
+static __thread struct kernel_slot *kslots;
+static __thread int kslots_cnt;
+static __thread int kslots_max;
+static __thread int kslot_free = -1;
+static __thread int *kfds;		/* first slot on each fd's list, + 1 */
+static __thread int kfds_max;
+static __thread struct up_kevent *kin;
+static __thread int kin_max;
+static __thread struct up_kevent *kout;
+static __thread int kout_max;
+
+static void *kernel_grow(void *arr, int *max, int want, size_t size)
+{
+	int old_max = *max;
+	int new_max = old_max ? old_max : 64;
+
+	if (want <= old_max)
+		return arr;
+	while (new_max < want)
+		new_max *= 2;
+	arr = realloc(arr, new_max * size);
+	if (!arr) {
+		perror("OOM");
+		exit(1);
+	}
+	memset((char *)arr + old_max * size, 0, (new_max - old_max) * size);
+	*max = new_max;
+	return arr;
+}
+
+static uint64_t kslot_get(const struct up_event *evt)
+{
+	struct kernel_slot *slot;
+	int idx = kslot_free;
+
+	if (idx >= 0) {
+		kslot_free = kslots[idx].next;
+	} else {
+		kslots = kernel_grow(kslots, &kslots_max, kslots_cnt + 1,
+				     sizeof(*kslots));
+		idx = kslots_cnt++;
+	}
+
+	slot = &kslots[idx];
+	slot->work_fn   = evt->work_fn;
+	slot->user_data = evt->user_data;
+	slot->flags     = evt->flags;
+	slot->fd        = evt->fd;
+	slot->input     = up_action_input(evt->type) && evt->fd >= 0;
+	slot->cancelled = false;
+	if (slot->input) {
+		kfds = kernel_grow(kfds, &kfds_max, evt->fd + 1, sizeof(*kfds));
+		slot->next = kfds[evt->fd] - 1;
+		kfds[evt->fd] = idx + 1;
+	}
+	return idx + 1;
+}
+
+static void kslot_put(uint64_t cookie, struct up_event *evt)
+{
+	int idx = cookie - 1;
+	struct kernel_slot *slot = &kslots[idx];
+	int prev = -1, cur;
+
+	if (slot->input) {
+		for (cur = kfds[slot->fd] - 1; cur != idx; cur = kslots[cur].next)
+			prev = cur;
+		if (prev < 0)
+			kfds[slot->fd] = slot->next + 1;
+		else
+			kslots[prev].next = slot->next;
+	}
+
+	evt->work_fn   = slot->work_fn;
+	evt->user_data = slot->user_data;
+	evt->flags     = slot->flags;
+	if (slot->cancelled)
+		evt->flags |= UP_F_CANCELED;
+	slot->next = kslot_free;
+	kslot_free = idx;
+}
+
+/*
+ * The original ABI has no way to take back a read or accept, so the ones
+ * cancel hits are only marked, and come back flagged whenever the kernel
+ * completes them.
+ */
+static void kernel_cancel(const struct up_event *cancel)
+{
+	struct kernel_slot *slot;
+
+	if (cancel->fd < 0 || cancel->fd >= kfds_max)
+		return;
+	for (int idx = kfds[cancel->fd] - 1; idx >= 0; idx = slot->next) {
+		slot = &kslots[idx];
+		if (!(cancel->flags & UP_F_MATCH) ||
+		    slot->user_data == cancel->user_data)
+			slot->cancelled = true;
+	}
+}
+
+/*
+ * flags always goes in, 0 for a plain submit: a kernel that knows the
+ * argument reads it whether or not it was passed, and one that predates
+ * it never looks.
+ */
+static int kernel_syscall(int upfd, int in_cnt, struct up_kevent *in,
+		int out_cnt, struct up_kevent *out, bool nowait)
+{
+	return syscall(SYS_upcall_submit, upfd, in_cnt, in, out_cnt, out,
+		       nowait ? UPCALL_SUBMIT_NOWAIT : 0);
+}
+
+/*
+ * Translate to and from the kernel's events around the syscall.  A failed
+ * submit is fatal to the worker, so the slots its actions took are not
+ * given back.  The UP_READ size hint means nothing to the kernel, which
+ * expects len 0 there as it always has.
+ */
+static int kernel_submit_events(int upfd, int in_cnt, struct up_event *in,
+		int out_cnt, struct up_event *out, bool nowait)
+{
+	int i, ret;
+
+	kin = kernel_grow(kin, &kin_max, in_cnt, sizeof(*kin));
+	kout = kernel_grow(kout, &kout_max, out_cnt, sizeof(*kout));
+
+	for (i = 0; i < in_cnt; i++) {
+		struct up_kevent *k = &kin[i];
+
+		k->fd     = in[i].fd;
+		k->result = 0;
+		k->buf    = in[i].buf;
+		k->len    = in[i].type == UP_READ ? 0 : in[i].len;
+		k->pad    = 0;
+		k->type   = in[i].type;
+		k->cookie = in[i].type == UP_VEC ? 0 : kslot_get(&in[i]);
+	}
+
+	ret = kernel_syscall(upfd, in_cnt, kin, out_cnt, kout, nowait);
+
+	for (i = 0; i < ret; i++) {
+		struct up_kevent *k = &kout[i];
+
+		memset(&out[i], 0, sizeof(out[i]));
+		out[i].fd     = k->fd;
+		out[i].result = k->result;
+		out[i].buf    = k->buf;
+		out[i].len    = k->len;
+		out[i].type   = k->type;
+		kslot_put(k->cookie, &out[i]);
+	}
+	return ret;
+}
+
+static int kernel_submit(int upfd, int in_cnt, struct up_event *in,
+		int out_cnt, struct up_event *out)
+{
+	return kernel_submit_events(upfd, in_cnt, in, out_cnt, out, false);
+}
+
+/*
+ * The flags word is the syscall's sixth argument.  A kernel that predates
+ * it ignores the register and waits as usual, so every "nowait" submit
+ * would block until unrelated I/O completes; kernel_probe_nowait() keeps
+ * this off such kernels.
+ */
+static int kernel_submit_nowait(int upfd, int in_cnt, struct up_event *in,
+		int out_cnt, struct up_event *out)
+{
+	return kernel_submit_events(upfd, in_cnt, in, out_cnt, out, true);
+}
+
+static void kernel_release(void)
+{
+	free(kslots);
+	free(kfds);
+	free(kin);
+	free(kout);
+	kslots = NULL;
+	kfds = NULL;
+	kin = kout = NULL;
+	kslots_cnt = kslots_max = kfds_max = kin_max = kout_max = 0;
+	kslot_free = -1;
+}
+
+/* What the original upcall ABI defines */
+#define KERNEL_ACTIONS	(UP_ACTION(UP_READ) | UP_ACTION(UP_WRITE) | \
+			 UP_ACTION(UP_ACCEPT) | UP_ACTION(UP_VEC))
+
+const struct upcall_backend upcall_kernel_backend = {
+	.name          = "kernel",
+	.create        = kernel_create,
+	.submit        = kernel_submit,
+	.submit_nowait = kernel_submit_nowait,
+	.release       = kernel_release,
+	.cancel        = kernel_cancel,
+	.multishot     = false,
+	.writev        = false,
+	.classes       = false,
+	.close         = false,
+	.actions       = KERNEL_ACTIONS,
+};
+
+/* The kernel backend on a kernel that ignores UPCALL_SUBMIT_NOWAIT */
+static const struct upcall_backend kernel_backend_wait = {
+	.name          = "kernel",
+	.create        = kernel_create,
+	.submit        = kernel_submit,
+	.submit_nowait = NULL,
+	.release       = kernel_release,
+	.cancel        = kernel_cancel,
+	.multishot     = false,
+	.writev        = false,
+	.classes       = false,
+	.close         = false,
+	.actions       = KERNEL_ACTIONS,
+};
+
+/*
+ * Does the kernel honour UPCALL_SUBMIT_NOWAIT?  Hand it one 8 byte buffer
+ * and a read of a timerfd that fires in a few milliseconds, with the flag
+ * set: a kernel that knows it comes straight back with nothing, one that
+ * ignores it waits for the timer.  The read is then reaped with a plain
+ * submit.  The buffer and its iovec are static as the kernel holds on to
+ * them until the upfd is closed.
+ */
+static bool kernel_probe_nowait(int upfd)
+{
+	static uint64_t probe_buf;
+	static struct iovec probe_iov = {
+		.iov_base	= &probe_buf,
+		.iov_len	= sizeof(probe_buf),
+	};
+	struct itimerspec its = { .it_value.tv_nsec = 10 * 1000 * 1000 };
+	struct up_kevent in[2], out;
+	int tfd, ret;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0)
+		return false;
+	if (timerfd_settime(tfd, 0, &its, NULL)) {
+		close(tfd);
+		return false;
+	}
+
+	memset(in, 0, sizeof(in));
+	in[0].type = UP_VEC;
+	in[0].buf  = &probe_iov;
+	in[0].len  = 1;
+	in[1].fd   = tfd;
+	in[1].type = UP_READ;
+
+	ret = kernel_syscall(upfd, 2, in, 1, &out, true);
+	if (!ret && kernel_syscall(upfd, 0, NULL, 1, &out, false) != 1)
+		ret = -1;
+	close(tfd);
+	return !ret;
+}
+
+static const struct upcall_backend *backends[] = {
+	&upcall_kernel_backend,
+	&upcall_epoll_backend,
+	NULL
+};
+
+static const struct upcall_backend *backend = &upcall_kernel_backend;
+
+/*
+ * Pick the backend named by $UPCALL_BACKEND, or the configure-time
+ * default if it is unset.
+ */
+static int select_backend(void)
+{
+	const char *name = getenv("UPCALL_BACKEND");
+
+	if (!name || !*name)
+		name = UPCALL_DEFAULT_BACKEND;
+
+	for (int i = 0; backends[i]; i++) {
+		if (!strcmp(backends[i]->name, name)) {
+			backend = backends[i];
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "libupcall: unknown backend '%s'\n", name);
+	return -EINVAL;
+}
+
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+static int backend_err;
+
+/*
+ * Settle the backend once per process, before the first pool is made, so
+ * a later pool cannot swap it under the workers of one already running.
+ * Under the kernel backend, probe a throwaway upfd and swap in
+ * kernel_backend_wait if the kernel does not honour UPCALL_SUBMIT_NOWAIT.
+ * A failed create is left for the pool's own upcall_create() to report.
+ */
+static void backend_init(void)
+{
+	int upfd;
+
+	backend_err = select_backend();
+	if (backend_err || backend != &upcall_kernel_backend)
+		return;
+
+	upfd = backend->create(0);
+	if (upfd < 0)
+		return;
+	if (!kernel_probe_nowait(upfd))
+		backend = &kernel_backend_wait;
+	close(upfd);
+}
+
+static int backend_setup(void)
+{
+	pthread_once(&backend_once, backend_init);
+	return backend_err;
+}
+
+static inline int upcall_create(int flags)
+{
+	return backend->create(flags);
+}
+
+static inline int upcall_submit(int upfd, int in_cnt, struct up_event *in,
 		int out_cnt, struct up_event *out)
 {
-	return syscall(SYS_upcall_submit, upfd, in_cnt, in, out_cnt, out);
+	return backend->submit(upfd, in_cnt, in, out_cnt, out);
 }
 
 /* ------------------------------------------------------------------ */
@@ -67,14 +485,125 @@ static int upcall_submit(int upfd, int in_cnt, struct up_event *in,
 static __thread struct up_event *work;
 static __thread int work_cnt;
 static __thread int work_max;
+/*
+ * A submit reaps up to recv_cnt completions into receive[].  The array
+ * has room for twice that: completions a dispatch budget put off stay at
+ * its front (recv_held of them) and the next submit reaps in behind them.
+ */
 static __thread struct up_event *receive;
 static __thread int recv_cnt;
-static __thread struct iovec *buffers;
-static __thread int buf_cnt;
-static __thread int buf_max;
+static __thread int recv_held;	/* deferred completions at the front */
+static __thread int recv_next;	/* next completion of the batch to dispatch */
+static __thread int recv_end;	/* completions in the batch */
+
+/*
+ * One size class of the worker's receive pool.  Its buffers sit in the
+ * arena from base on: count for the backend, count spares that replace
+ * the ones applications retain, then the reserve pool_refill() keeps the
+ * backend supplied from while applications hold on to buffers.  'buffers'
+ * collects what has come back since the last submit and goes out as the
+ * class's own UP_VEC.
+ */
+struct buf_class {
+	size_t		size;
+	size_t		stride;
+	size_t		nr;		/* pool, spare and reserve buffers at base */
+	uint8_t		*base;
+	int		count;		/* what the backend should hold */
+	int		held;		/* what it does hold */
+	int		low;
+	int		high;
+	bool		stalled;	/* below low with the reserve spent */
+	struct iovec	*buffers;
+	int		buf_cnt;
+	int		buf_max;
+	struct iovec	*spares;
+	int		spare_cnt;
+	int		spare_max;
+	struct iovec	*reserve;
+	int		reserve_cnt;
+	int		reserve_max;
+};
+
+/* Smallest class first */
+static __thread struct buf_class pool_classes[UPCALL_BUF_CLASSES];
+static __thread int nr_pool_classes;
+
+/* The worker's pool buffers, carved from one contiguous mapping */
+static __thread uint8_t *arena;
+static __thread size_t arena_sz;
+
+/*
+ * Shutdown state: once draining, the worker takes no new connections and
+ * only waits for the writes it has queued or in flight.
+ */
+static __thread bool draining;
+static __thread int writes_inflight;
+
+/*
+ * Counters for upcall_stats().  Only the owning worker writes them; the
+ * relaxed stores keep the plain increments from tearing for readers.
+ */
+static __thread struct upcall_stats wstats;
+
+#define STAT_ADD(field, n) \
+	__atomic_store_n(&wstats.field, wstats.field + (n), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) \
+	__atomic_store_n(&wstats.field, (v), __ATOMIC_RELAXED)
+
+static inline uint64_t upcall_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int batch_bucket(int cnt)
+{
+	int bucket = 0;
+
+	while (cnt && bucket < UPCALL_STATS_BATCH_BUCKETS - 1) {
+		cnt >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/*
+ * Phase tracing, compiled in with UPCALL_TRACE (--enable-upcall-trace).
+ * Every worker owns a TscLog of UPCALL_TRACE_ENTRIES four-value entries:
+ * phase plus the three values upcall.h documents for it.  Entries past
+ * the end are dropped and the log is marked as overflowed.
+ */
+#ifdef UPCALL_TRACE
+#ifndef UPCALL_TRACE_ENTRIES
+#define UPCALL_TRACE_ENTRIES (1 << 20)
+#endif
+
+static __thread struct TscLog *trace_log;
+
+#define TRACE(phase, a, b, c) \
+	tsclog_4(trace_log, (phase), (uint64_t)(a), (uint64_t)(b), (uint64_t)(c))
+#else
+#define TRACE(phase, a, b, c) do { } while (0)
+#endif
 
 static void expand_queue(void)
 {
+	STAT_ADD(work_reallocs, 1);
 	work_max += EVTS;
 	work = realloc(work, work_max * sizeof(struct up_event));
 	if (!work) {
@@ -83,252 +612,2538 @@ static void expand_queue(void)
 	}
 }
 
-static void add_buffers(struct iovec *bufs, size_t cnt)
+static void iov_push(struct iovec **iov, int *cnt, int *max, void *buf,
+		     size_t len)
+{
+	if (*cnt == *max) {
+		*max *= 2;
+		*iov = realloc(*iov, *max * sizeof(struct iovec));
+		if (!*iov) {
+			perror("OOM growing buffer pool");
+			exit(1);
+		}
+	}
+	(*iov)[*cnt].iov_base = buf;
+	(*iov)[*cnt].iov_len  = len;
+	(*cnt)++;
+}
+
+static void add_buffers(int cls, struct iovec *bufs, size_t cnt)
 {
 	if (work_cnt == work_max)
 		expand_queue();
 
 	memset(&work[work_cnt], 0, sizeof(struct up_event));
+	work[work_cnt].fd   = cls;
 	work[work_cnt].type = UP_VEC;
 	work[work_cnt].buf  = (void *)bufs;
 	work[work_cnt].len  = cnt;
 	work_cnt++;
+	pool_classes[cls].held += cnt;
+	STAT_ADD(pool_depth, cnt);
 }
 
-void return_buffer(void *buf, size_t len)
+/*
+ * Hand everything returned since the last submit back, class by class,
+ * keeping what the backend holds between the watermarks.  A class that
+ * has dropped below its low mark, because callbacks are sitting on its
+ * buffers, is topped back up to count from the reserve; one that would
+ * end up over its high mark once they come back returns the surplus.
+ * Running out of reserve below the low mark counts as one stall, however
+ * many submits it lasts.
+ */
+static void pool_refill(void)
 {
-	if (buf_cnt == buf_max) {
-		buf_max *= 2;
-		buffers = realloc(buffers, buf_max * sizeof(struct iovec));
-		if (!buffers) {
-			perror("OOM growing buffer pool");
-			exit(1);
+	struct buf_class *pc;
+	struct iovec *iov;
+	int depth;
+
+	for (int c = 0; c < nr_pool_classes; c++) {
+		pc    = &pool_classes[c];
+		depth = pc->held + pc->buf_cnt;
+
+		if (depth < pc->low) {
+			while (depth < pc->count && pc->reserve_cnt) {
+				iov = &pc->reserve[--pc->reserve_cnt];
+				iov_push(&pc->buffers, &pc->buf_cnt, &pc->buf_max,
+					 iov->iov_base, iov->iov_len);
+				depth++;
+				STAT_ADD(pool_refills, 1);
+			}
+			if (depth < pc->low && !pc->stalled)
+				STAT_ADD(pool_stalls, 1);
+		} else if (depth > pc->high) {
+			while (depth > pc->count && pc->buf_cnt) {
+				iov = &pc->buffers[--pc->buf_cnt];
+				iov_push(&pc->reserve, &pc->reserve_cnt,
+					 &pc->reserve_max, iov->iov_base,
+					 iov->iov_len);
+				depth--;
+				STAT_ADD(pool_trims, 1);
+			}
 		}
+		pc->stalled = depth < pc->low;
+
+		if (pc->buf_cnt > 0)
+			add_buffers(c, pc->buffers, pc->buf_cnt);
 	}
-	buffers[buf_cnt].iov_base = buf;
-	buffers[buf_cnt].iov_len  = len;
-	buf_cnt++;
 }
 
-static void upcall_worker_setup(int upfd, size_t bufs, size_t buf_sz)
+/*
+ * Map 'size' bytes for the pool and prefault all of it.  Huge arenas
+ * prefer reserved 2MB pages, then transparent huge pages on a 2MB aligned
+ * range.  Workers are already pinned when this runs, so first touch
+ * places the arena on the worker's own NUMA node.
+ */
+static void *arena_map(size_t size, bool huge)
 {
-	work_max  = 4 * EVTS;
-	recv_cnt  = bufs;	/* match completions to pool size */
-	work_cnt  = 0;
+	uint8_t *p, *aligned;
 
-	work = calloc(work_max, sizeof(struct up_event));
-	if (!work) {
-		perror("OOM");
-		exit(1);
+	if (!huge) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		return p == MAP_FAILED ? NULL : p;
 	}
 
-	receive = calloc(recv_cnt, sizeof(struct up_event));
-	if (!receive) {
-		perror("OOM");
-		exit(1);
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+
+	p = mmap(NULL, size + HUGE_PAGE_SZ, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	aligned = (uint8_t *)(((uintptr_t)p + HUGE_PAGE_SZ - 1) & ~(HUGE_PAGE_SZ - 1));
+	if (aligned > p)
+		munmap(p, aligned - p);
+	munmap(aligned + size, p + HUGE_PAGE_SZ - aligned);
+
+	madvise(aligned, size, MADV_HUGEPAGE);
+	for (size_t off = 0; off < size; off += BASE_PAGE_SZ)
+		*(volatile uint8_t *)(aligned + off) = 0;
+
+	return aligned;
+}
+
+/*
+ * Lay the classes out one after the other in a single arena, each
+ * starting on its own alignment: cache lines, or pages for classes of
+ * 4KB and up.
+ */
+static void arena_setup(const struct upcall_buf_class *cls, int nr)
+{
+	struct buf_class *pc;
+	size_t off = 0;
+	size_t align, page;
+	bool huge;
+
+	for (int c = 0; c < nr; c++) {
+		pc    = &pool_classes[c];
+		align = cls[c].size >= BASE_PAGE_SZ ? BASE_PAGE_SZ : CACHE_LINE_SZ;
+		off   = (off + align - 1) & ~(align - 1);
+
+		pc->size   = cls[c].size;
+		pc->stride = (cls[c].size + align - 1) & ~(align - 1);
+		pc->nr     = 2 * cls[c].count +
+			     cls[c].count * UPCALL_POOL_RESERVE / 100;
+		pc->base   = (uint8_t *)off;	/* relative until mapped */
+		off += pc->nr * pc->stride;
 	}
 
-	buffers = calloc(bufs, sizeof(struct iovec));
-	if (!buffers) {
-		perror("OOM");
+	/* Pools under 1MB would waste most of a 2MB page */
+	huge     = off >= HUGE_PAGE_SZ / 2;
+	page     = huge ? HUGE_PAGE_SZ : BASE_PAGE_SZ;
+	arena_sz = (off + page - 1) & ~(page - 1);
+
+	arena = arena_map(arena_sz, huge);
+	if (!arena) {
+		perror("OOM mapping buffer arena");
 		exit(1);
 	}
-	buf_max = bufs;
-	for (buf_cnt = 0; buf_cnt < buf_max; buf_cnt++) {
-		buffers[buf_cnt].iov_len  = buf_sz;
-		buffers[buf_cnt].iov_base = calloc(1, buf_sz);
-		if (!buffers[buf_cnt].iov_base) {
-			perror("OOM");
-			exit(1);
-		}
-	}
-
-	/* buf_cnt stays at bufs here; reset to 0 so run_event_loop's
-	 * "if (buf_cnt > 0) add_buffers(...)" doesn't submit a second
-	 * UP_VEC pointing at the same pool, which would duplicate every
-	 * buffer pointer and cause silent data corruption. */
-	buf_cnt = 0;
-	add_buffers(buffers, buf_max);
+	for (int c = 0; c < nr; c++)
+		pool_classes[c].base = arena + (uintptr_t)pool_classes[c].base;
 }
 
-void add_read(int fd, void (*work_fn)(struct up_event *evt))
+static inline bool in_arena(void *buf)
 {
-	if (work_cnt == work_max)
-		expand_queue();
-
-	memset(&work[work_cnt], 0, sizeof(struct up_event));
-	work[work_cnt].fd      = fd;
-	work[work_cnt].type    = UP_READ;
-	work[work_cnt].work_fn = work_fn;
-	work_cnt++;
+	return (uint8_t *)buf >= arena && (uint8_t *)buf < arena + arena_sz;
 }
 
-void add_write(int fd, void *buf, size_t len,
-	       void (*work_fn)(struct up_event *evt))
+/*
+ * Class of a pool buffer, or -1 for a replacement the application
+ * allocated itself.  Buffers from the arena must come back exactly as
+ * handed out.
+ */
+static int pool_class(void *buf, const char *who)
 {
-	if (work_cnt == work_max)
-		expand_queue();
+	struct buf_class *pc;
+	size_t off;
 
-	memset(&work[work_cnt], 0, sizeof(struct up_event));
-	work[work_cnt].fd      = fd;
-	work[work_cnt].buf     = buf;
-	work[work_cnt].len     = len;
-	work[work_cnt].type    = UP_WRITE;
-	work[work_cnt].work_fn = work_fn;
-	work_cnt++;
+	if (!in_arena(buf))
+		return -1;
+
+	for (int c = 0; c < nr_pool_classes; c++) {
+		pc = &pool_classes[c];
+		if ((uint8_t *)buf < pc->base)
+			break;
+		off = (uint8_t *)buf - pc->base;
+		if (off >= pc->nr * pc->stride)
+			continue;
+		if (off % pc->stride)
+			break;
+		return c;
+	}
+
+	fprintf(stderr, "libupcall: %s(%p) is not a pool buffer\n", who, buf);
+	abort();
 }
 
-void add_accept(int fd, void (*work_fn)(struct up_event *evt))
+/* Largest class an application buffer of len bytes can stand in for */
+static int foreign_class(size_t len)
 {
-	if (work_cnt == work_max)
-		expand_queue();
+	int c = nr_pool_classes - 1;
 
-	work[work_cnt].fd      = fd;
-	work[work_cnt].type    = UP_ACCEPT;
-	work[work_cnt].work_fn = work_fn;
-	work_cnt++;
+	while (c > 0 && pool_classes[c].size > len)
+		c--;
+	return c;
 }
 
-static void run_event_loop(int upfd, int continuous)
+/* A read completed into buf, which the backend no longer holds */
+static void pool_taken(void *buf, size_t len)
 {
-	int ret;
-
-	do {
-		if (buf_cnt > 0)
-			add_buffers(buffers, buf_cnt);
-		ret = upcall_submit(upfd, work_cnt, work, recv_cnt, receive);
-		if (ret < 0) {
-			perror("upcall_submit failed");
-			exit(1);
-		}
+	int c = pool_class(buf, "read completion");
 
-		buf_cnt  = 0;
-		work_cnt = 0;
-		for (int i = 0; i < ret; i++)
-			receive[i].work_fn(&receive[i]);
-		memset(receive, 0, recv_cnt * sizeof(struct up_event));
-	} while (continuous);
+	if (c < 0)
+		c = foreign_class(len);
+	pool_classes[c].held--;
+	STAT_ADD(pool_depth, -1);
 }
 
-/* ------------------------------------------------------------------ */
-/* Managed worker pool                                                 */
-/* ------------------------------------------------------------------ */
+void return_buffer(void *buf, size_t len)
+{
+	struct buf_class *pc;
+	int c = pool_class(buf, "return_buffer");
 
-static int    g_upfd       = -1;
-static int    g_nr_workers = 0;
-static size_t g_bufs;
-static size_t g_buf_sz;
-static void (*g_setup_fn)(int worker_id, int nr_workers);
-static void (*g_loop_fn)(void);
+	if (c >= 0) {
+		pc  = &pool_classes[c];
+		len = pc->size;
+	} else {
+		pc = &pool_classes[foreign_class(len)];
+		if (len > pc->size)
+			len = pc->size;
+	}
+	iov_push(&pc->buffers, &pc->buf_cnt, &pc->buf_max, buf, len);
+}
 
-static __thread int g_worker_id_tls = -1;
+void *upcall_buf_retain(struct up_event *evt)
+{
+	void *buf = evt->buf;
+	struct buf_class *pc;
+	struct iovec *spare;
+	int c;
 
-/* init barrier: main waits for all workers to complete setup_fn */
-static pthread_mutex_t g_init_lock  = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  g_init_cond  = PTHREAD_COND_INITIALIZER;
-static int             g_init_count = 0;
+	if (!buf)
+		return NULL;
 
-/* go barrier: workers wait for upcall_workers_go() */
-static bool           g_go      = false;
-static pthread_cond_t g_go_cond = PTHREAD_COND_INITIALIZER;
+	c = pool_class(buf, "upcall_buf_retain");
+	if (c < 0)
+		c = foreign_class(evt->len);
+	pc = &pool_classes[c];
+	if (!pc->spare_cnt)
+		return NULL;
 
-size_t upcall_buf_sz(void)
-{
-	return g_buf_sz;
+	spare = &pc->spares[--pc->spare_cnt];
+	return_buffer(spare->iov_base, spare->iov_len);
+	evt->buf = NULL;
+	return buf;
 }
 
-int upcall_nr_workers(void)
+void upcall_buf_release(void *buf)
 {
-	return get_nprocs();
-}
+	struct buf_class *pc;
+	int c = pool_class(buf, "upcall_buf_release");
 
-int upcall_worker_id(void)
-{
-	return g_worker_id_tls;
+	/* Replacement buffers are upcall_buf_sz() bytes, enough for any class */
+	if (c < 0)
+		c = nr_pool_classes - 1;
+
+	pc = &pool_classes[c];
+	iov_push(&pc->spares, &pc->spare_cnt, &pc->spare_max, buf, pc->size);
 }
 
-static void *upcall_worker_fn(void *arg)
+static void upcall_worker_setup(int upfd, const struct upcall_buf_class *cls,
+				int nr)
 {
-	int id = (intptr_t)arg;
+	struct buf_class *pc;
+	size_t count;
 
-	g_worker_id_tls = id;
-
-	upcall_worker_setup(g_upfd, g_bufs, g_buf_sz);
+	work_max  = 4 * EVTS;
+	work_cnt  = 0;
 
-	if (g_setup_fn)
-		g_setup_fn(id, g_nr_workers);
+	/* match completions to pool size */
+	recv_cnt = 0;
+	for (int c = 0; c < nr; c++)
+		recv_cnt += cls[c].count;
 
-	/* Signal setup done, then wait for workers_go */
-	pthread_mutex_lock(&g_init_lock);
-	g_init_count++;
-	pthread_cond_signal(&g_init_cond);
-	while (!g_go)
-		pthread_cond_wait(&g_go_cond, &g_init_lock);
-	pthread_mutex_unlock(&g_init_lock);
+	work = calloc(work_max, sizeof(struct up_event));
+	if (!work) {
+		perror("OOM");
+		exit(1);
+	}
 
-	for (;;) {
-		run_event_loop(g_upfd, false);
-		if (g_loop_fn)
-			g_loop_fn();
+	receive = calloc(2 * recv_cnt, sizeof(struct up_event));
+	if (!receive) {
+		perror("OOM");
+		exit(1);
 	}
-	return NULL;
-}
 
-int upcall_init(size_t bufs, size_t buf_sz,
-		void (*setup_fn)(int worker_id, int nr_workers),
-		void (*loop_fn)(void))
-{
-	int nr = get_nprocs();
-	pthread_attr_t attr;
-	cpu_set_t cpuset;
-	pthread_t tid;
-	int ret;
+	nr_pool_classes = nr;
+	arena_setup(cls, nr);
 
-	g_upfd = upcall_create(0);
-	if (g_upfd < 0)
-		return -errno;
+	for (int c = 0; c < nr; c++) {
+		pc    = &pool_classes[c];
+		count = cls[c].count;
 
-	g_nr_workers = nr;
-	g_bufs       = bufs;
-	g_buf_sz     = buf_sz;
-	g_setup_fn   = setup_fn;
-	g_loop_fn    = loop_fn;
+		/* One spare per pool buffer, so everything can be retained at once */
+		pc->buffers = calloc(count, sizeof(struct iovec));
+		pc->spares  = calloc(count, sizeof(struct iovec));
+		if (!pc->buffers || !pc->spares) {
+			perror("OOM");
+			exit(1);
+		}
+		pc->buf_max   = count;
+		pc->spare_max = count;
+		pc->count     = count;
+		pc->low       = count * UPCALL_POOL_LOW / 100;
+		pc->high      = count * UPCALL_POOL_HIGH / 100;
 
-	ret = pthread_attr_init(&attr);
-	if (ret)
-		return -ret;
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		for (size_t i = 0; i < count; i++) {
+			pc->buffers[i].iov_len  = pc->size;
+			pc->buffers[i].iov_base = pc->base + i * pc->stride;
+			pc->spares[i].iov_len   = pc->size;
+			pc->spares[i].iov_base  = pc->base + (count + i) * pc->stride;
+		}
+		pc->spare_cnt = count;
 
+		pc->reserve_cnt = pc->nr - 2 * count;
+		pc->reserve_max = pc->reserve_cnt ? pc->reserve_cnt : 1;
+		pc->reserve = calloc(pc->reserve_max, sizeof(struct iovec));
+		if (!pc->reserve) {
+			perror("OOM");
+			exit(1);
+		}
+		for (int i = 0; i < pc->reserve_cnt; i++) {
+			pc->reserve[i].iov_len  = pc->size;
+			pc->reserve[i].iov_base = pc->base + (2 * count + i) * pc->stride;
+		}
+
+		/*
+		 * buf_cnt stays 0 so run_event_loop's pool_refill() doesn't
+		 * submit a second UP_VEC pointing at the same buffers, which
+		 * would duplicate every buffer pointer and cause silent data
+		 * corruption.
+		 */
+		pc->buf_cnt = 0;
+		add_buffers(c, pc->buffers, count);
+	}
+}
+
+/* Actions upcall_ctx_fini() waits for */
+static inline bool is_write(up_action_t type)
+{
+	return type == UP_WRITE || type == UP_WRITEV || type == UP_PWRITE ||
+	       type == UP_SENDFILE;
+}
+
+/*
+ * Completions made up in libupcall, for actions that never reach the
+ * backend.  They are delivered from the event loop ahead of the next
+ * submit, like timers, never from inside the add_*() call.
+ */
+static __thread struct up_event *local;
+static __thread int local_cnt;
+static __thread int local_max;
+
+/*
+ * Cancels made since the current callback started, on a backend without
+ * multishot: dispatch_rearm() must not renew a registration they hit
+ * from inside its own callback.
+ */
+static __thread struct up_event *rearm_cancels;
+static __thread int rearm_cancels_cnt;
+static __thread int rearm_cancels_max;
+
+static void rearm_cancel_add(const struct up_event *cancel)
+{
+	if (rearm_cancels_cnt == rearm_cancels_max) {
+		rearm_cancels_max = rearm_cancels_max ? 2 * rearm_cancels_max : EVTS;
+		rearm_cancels = realloc(rearm_cancels,
+					rearm_cancels_max * sizeof(struct up_event));
+		if (!rearm_cancels) {
+			perror("OOM");
+			exit(1);
+		}
+	}
+	rearm_cancels[rearm_cancels_cnt++] = *cancel;
+}
+
+static bool rearm_cancelled(const struct up_event *armed)
+{
+	for (int i = 0; i < rearm_cancels_cnt; i++)
+		if (up_cancel_hits(&rearm_cancels[i], armed))
+			return true;
+	return false;
+}
+
+static void local_complete(int fd, up_action_t type, void *buf, size_t len,
+			   void (*work_fn)(struct up_event *evt),
+			   uint32_t flags, uint64_t user_data, int32_t result)
+{
+	struct up_event *evt;
+
+	if (local_cnt == local_max) {
+		local_max = local_max ? 2 * local_max : EVTS;
+		local = realloc(local, local_max * sizeof(struct up_event));
+		if (!local) {
+			perror("OOM");
+			exit(1);
+		}
+	}
+
+	evt = &local[local_cnt++];
+	memset(evt, 0, sizeof(struct up_event));
+	evt->fd        = fd;
+	evt->result    = result;
+	evt->buf       = buf;
+	evt->len       = len;
+	evt->type      = type;
+	evt->flags     = flags;
+	evt->work_fn   = work_fn;
+	evt->user_data = user_data;
+}
+
+static void queue_action_data(int fd, up_action_t type, void *buf, size_t len,
+			      void (*work_fn)(struct up_event *evt),
+			      uint32_t flags, uint64_t user_data)
+{
+	if (type == UP_ACCEPT && draining)
+		return;
+	if (is_write(type))
+		writes_inflight++;
+
+	/* Never hand a backend an action it does not know */
+	if (!(backend->actions & UP_ACTION(type))) {
+		local_complete(fd, type, buf, len, work_fn, flags, user_data,
+			       -EOPNOTSUPP);
+		return;
+	}
+
+	if (work_cnt == work_max)
+		expand_queue();
+
+	memset(&work[work_cnt], 0, sizeof(struct up_event));
+	work[work_cnt].fd        = fd;
+	work[work_cnt].buf       = buf;
+	work[work_cnt].len       = len;
+	work[work_cnt].type      = type;
+	work[work_cnt].flags     = flags;
+	work[work_cnt].work_fn   = work_fn;
+	work[work_cnt].user_data = user_data;
+	work_cnt++;
+}
+
+static inline void queue_action(int fd, up_action_t type, void *buf,
+				size_t len,
+				void (*work_fn)(struct up_event *evt),
+				uint32_t flags)
+{
+	queue_action_data(fd, type, buf, len, work_fn, flags, 0);
+}
+
+void add_read(int fd, void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_READ, NULL, 0, work_fn, 0);
+}
+
+void add_read_hint(int fd, size_t size_hint,
+		   void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_READ, NULL, size_hint, work_fn, 0);
+}
+
+void add_write(int fd, void *buf, size_t len,
+	       void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_WRITE, buf, len, work_fn, 0);
+}
+
+void add_accept(int fd, void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_ACCEPT, NULL, 0, work_fn, 0);
+}
+
+void add_read_data(int fd, void (*work_fn)(struct up_event *evt),
+		   uint64_t user_data)
+{
+	queue_action_data(fd, UP_READ, NULL, 0, work_fn, 0, user_data);
+}
+
+void add_read_multishot_data(int fd, void (*work_fn)(struct up_event *evt),
+			     uint64_t user_data)
+{
+	queue_action_data(fd, UP_READ, NULL, 0, work_fn, UP_F_MULTISHOT,
+			  user_data);
+}
+
+void add_accept_data(int fd, void (*work_fn)(struct up_event *evt),
+		     uint64_t user_data)
+{
+	queue_action_data(fd, UP_ACCEPT, NULL, 0, work_fn, 0, user_data);
+}
+
+void add_accept_multishot_data(int fd, void (*work_fn)(struct up_event *evt),
+			       uint64_t user_data)
+{
+	queue_action_data(fd, UP_ACCEPT, NULL, 0, work_fn, UP_F_MULTISHOT,
+			  user_data);
+}
+
+void add_write_data(int fd, void *buf, size_t len,
+		    void (*work_fn)(struct up_event *evt), uint64_t user_data)
+{
+	queue_action_data(fd, UP_WRITE, buf, len, work_fn, 0, user_data);
+}
+
+void add_connect(int fd, const struct sockaddr *addr, socklen_t addrlen,
+		 void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_CONNECT, (void *)addr, addrlen, work_fn, 0);
+}
+
+void add_connect_data(int fd, const struct sockaddr *addr, socklen_t addrlen,
+		      void (*work_fn)(struct up_event *evt),
+		      uint64_t user_data)
+{
+	queue_action_data(fd, UP_CONNECT, (void *)addr, addrlen, work_fn, 0,
+			  user_data);
+}
+
+void add_poll(int fd, uint32_t events, void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_POLL, NULL, events, work_fn, 0);
+}
+
+void add_poll_multishot(int fd, uint32_t events,
+			void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_POLL, NULL, events, work_fn, UP_F_MULTISHOT);
+}
+
+void add_poll_data(int fd, uint32_t events,
+		   void (*work_fn)(struct up_event *evt), uint64_t user_data)
+{
+	queue_action_data(fd, UP_POLL, NULL, events, work_fn, 0, user_data);
+}
+
+void add_pread(int fd, struct up_file_io *io,
+	       void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_PREAD, io, io->len, work_fn, 0);
+}
+
+void add_pwrite(int fd, struct up_file_io *io,
+		void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_PWRITE, io, io->len, work_fn, 0);
+}
+
+void add_sendfile(int fd, struct up_file_io *io,
+		  void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_SENDFILE, io, io->len, work_fn, 0);
+}
+
+/* Completion handler for closes and shutdowns nobody waits for */
+static void ignore_done(struct up_event *evt)
+{
+}
+
+/*
+ * Give an input completion the -ECANCELED treatment, as the backend gives
+ * its own: its pool buffer goes back and a socket it accepted is closed.
+ * Returns false for one that is dropped instead, as the backend will
+ * cancel the live registration itself.
+ */
+static bool cancel_input(struct up_event *evt)
+{
+	if (evt->type == UP_READ && evt->buf) {
+		pool_taken(evt->buf, evt->len);
+		return_buffer(evt->buf, evt->len);
+		evt->buf = NULL;
+	} else if (evt->type == UP_ACCEPT && evt->result >= 0) {
+		close(evt->result);
+	}
+	if (!up_event_final(evt) && backend->multishot)
+		return false;
+	evt->result = -ECANCELED;
+	return true;
+}
+
+/*
+ * The rest of this batch may already hold completions the cancel hits.
+ * Input ones are turned into the cancellation, or dropped, here.
+ */
+static void cancel_reaped(const struct up_event *cancel)
+{
+	struct up_event *evt;
+	int kept = recv_next;
+
+	if (!backend->multishot)
+		rearm_cancel_add(cancel);
+
+	for (int i = recv_next; i < recv_end; i++) {
+		evt = &receive[i];
+		if (up_cancel_hits(cancel, evt) && up_action_input(evt->type) &&
+		    !cancel_input(evt))
+			continue;
+		receive[kept++] = *evt;
+	}
+	recv_end = kept;
+}
+
+/*
+ * Backends without UP_CANCEL: the actions cancel hits that are still
+ * queued never go out, and complete with -ECANCELED from here instead.
+ */
+static void cancel_queued(const struct up_event *cancel)
+{
+	struct up_event *evt;
+	int kept = 0;
+
+	for (int i = 0; i < work_cnt; i++) {
+		evt = &work[i];
+		if (evt->type != UP_VEC && up_cancel_hits(cancel, evt)) {
+			local_complete(evt->fd, evt->type, evt->buf, evt->len,
+				       evt->work_fn, evt->flags,
+				       evt->user_data, -ECANCELED);
+			continue;
+		}
+		work[kept++] = *evt;
+	}
+	work_cnt = kept;
+}
+
+/* What libupcall cancels itself when the backend cannot */
+static void cancel_local(const struct up_event *cancel)
+{
+	cancel_queued(cancel);
+	if (backend->cancel)
+		backend->cancel(cancel);
+}
+
+/*
+ * Cancel what cancel hits, with the backend's UP_CANCEL if it has one.
+ * Otherwise libupcall does it, and the UP_CANCEL completes locally with 0.
+ */
+static void queue_cancel(const struct up_event *cancel,
+			 void (*work_fn)(struct up_event *evt))
+{
+	cancel_reaped(cancel);
+	if (!work_fn)
+		work_fn = ignore_done;
+
+	if (backend->actions & UP_ACTION(UP_CANCEL)) {
+		queue_action_data(cancel->fd, UP_CANCEL, NULL, 0, work_fn,
+				  cancel->flags, cancel->user_data);
+		return;
+	}
+
+	cancel_local(cancel);
+	local_complete(cancel->fd, UP_CANCEL, NULL, 0, work_fn, cancel->flags,
+		       cancel->user_data, 0);
+}
+
+void add_cancel(int fd, void (*work_fn)(struct up_event *evt))
+{
+	struct up_event cancel = { .fd = fd };
+
+	queue_cancel(&cancel, work_fn);
+}
+
+void add_cancel_data(int fd, void (*work_fn)(struct up_event *evt),
+		     uint64_t user_data)
+{
+	struct up_event cancel = {
+		.fd		= fd,
+		.flags		= UP_F_MATCH,
+		.user_data	= user_data,
+	};
+
+	queue_cancel(&cancel, work_fn);
+}
+
+/*
+ * A backend without UP_CLOSE has the fd closed here and now, once nothing
+ * queued on it can still go out.
+ */
+void add_close(int fd, void (*work_fn)(struct up_event *evt))
+{
+	struct up_event cancel = { .fd = fd };
+
+	if (!work_fn)
+		work_fn = ignore_done;
+
+	cancel_reaped(&cancel);
+	if (backend->close) {
+		queue_action(fd, UP_CLOSE, NULL, 0, work_fn, 0);
+		return;
+	}
+
+	cancel_local(&cancel);
+	local_complete(fd, UP_CLOSE, NULL, 0, work_fn, 0, 0,
+		       close(fd) ? -errno : 0);
+}
+
+void add_shutdown(int fd, int how, void (*work_fn)(struct up_event *evt))
+{
+	if (!work_fn)
+		work_fn = ignore_done;
+
+	if (backend->close) {
+		queue_action(fd, UP_SHUTDOWN, NULL, how, work_fn, 0);
+		return;
+	}
+
+	local_complete(fd, UP_SHUTDOWN, NULL, how, work_fn, 0, 0,
+		       shutdown(fd, how) ? -errno : 0);
+}
+
+void add_read_multishot(int fd, void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_READ, NULL, 0, work_fn, UP_F_MULTISHOT);
+}
+
+void add_read_multishot_hint(int fd, size_t size_hint,
+			     void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_READ, NULL, size_hint, work_fn, UP_F_MULTISHOT);
+}
+
+void add_accept_multishot(int fd, void (*work_fn)(struct up_event *evt))
+{
+	queue_action(fd, UP_ACCEPT, NULL, 0, work_fn, UP_F_MULTISHOT);
+}
+
+/* ------------------------------------------------------------------ */
+/* Vectored writes                                                     */
+/* ------------------------------------------------------------------ */
+
+/*
+ * In-flight add_writev() state, one slot per fd and reused for the life of
+ * the worker so a writev costs no allocation once the fd has been seen.
+ * iov is our copy of the caller's array; the entry at idx is trimmed in
+ * place as short writes eat into it.
+ */
+struct writev_state {
+	bool		busy;
+	int		cap;
+	int		cnt;
+	int		idx;
+	int32_t		written;
+	const struct iovec *user_iov;
+	void		(*work_fn)(struct up_event *evt);
+	uint64_t	user_data;
+	struct iovec	*iov;
+};
+
+static __thread struct writev_state *writevs;
+static __thread int writevs_max;
+
+static struct writev_state *writev_slot(int fd)
+{
+	int max = writevs_max ? writevs_max : 1024;
+
+	if (fd < writevs_max)
+		return &writevs[fd];
+
+	while (max <= fd)
+		max *= 2;
+	writevs = realloc(writevs, max * sizeof(struct writev_state));
+	if (!writevs) {
+		perror("OOM");
+		exit(1);
+	}
+	memset(&writevs[writevs_max], 0,
+	       (max - writevs_max) * sizeof(struct writev_state));
+	writevs_max = max;
+	return &writevs[fd];
+}
+
+static void writev_step(struct up_event *evt);
+
+static void writev_submit(int fd, struct writev_state *st)
+{
+	struct iovec *cur = &st->iov[st->idx];
+
+	if (backend->writev)
+		queue_action_data(fd, UP_WRITEV, cur, st->cnt - st->idx,
+				  writev_step, 0, st->user_data);
+	else
+		queue_action_data(fd, UP_WRITE, cur->iov_base, cur->iov_len,
+				  writev_step, 0, st->user_data);
+}
+
+static void writev_step(struct up_event *evt)
+{
+	struct writev_state *st = &writevs[evt->fd];
+	struct up_event done;
+	size_t n;
+
+	if (evt->result > 0) {
+		st->written += evt->result;
+		n = evt->result;
+		while (st->idx < st->cnt && n >= st->iov[st->idx].iov_len) {
+			n -= st->iov[st->idx].iov_len;
+			st->idx++;
+		}
+		if (st->idx < st->cnt) {
+			st->iov[st->idx].iov_base = (uint8_t *)st->iov[st->idx].iov_base + n;
+			st->iov[st->idx].iov_len -= n;
+			writev_submit(evt->fd, st);
+			return;
+		}
+	}
+
+	memset(&done, 0, sizeof(done));
+	done.fd        = evt->fd;
+	done.result    = evt->result > 0 ? st->written : evt->result;
+	done.buf       = (void *)st->user_iov;
+	done.len       = st->cnt;
+	done.type      = UP_WRITEV;
+	done.flags     = UP_F_LAST;
+	done.work_fn   = st->work_fn;
+	done.user_data = st->user_data;
+	st->busy = false;
+	done.work_fn(&done);
+}
+
+int add_writev_data(int fd, const struct iovec *iov, int iovcnt,
+		    void (*work_fn)(struct up_event *evt), uint64_t user_data)
+{
+	struct writev_state *st;
+
+	if (fd < 0 || iovcnt <= 0 || iovcnt > IOV_MAX)
+		return -EINVAL;
+
+	st = writev_slot(fd);
+	if (st->busy)
+		return -EBUSY;
+
+	if (iovcnt > st->cap) {
+		st->iov = realloc(st->iov, iovcnt * sizeof(struct iovec));
+		if (!st->iov) {
+			perror("OOM");
+			exit(1);
+		}
+		st->cap = iovcnt;
+	}
+
+	memcpy(st->iov, iov, iovcnt * sizeof(struct iovec));
+	st->busy      = true;
+	st->cnt       = iovcnt;
+	st->idx       = 0;
+	st->written   = 0;
+	st->user_iov  = iov;
+	st->work_fn   = work_fn;
+	st->user_data = user_data;
+	writev_submit(fd, st);
+	return 0;
+}
+
+int add_writev(int fd, const struct iovec *iov, int iovcnt,
+	       void (*work_fn)(struct up_event *evt))
+{
+	return add_writev_data(fd, iov, iovcnt, work_fn, 0);
+}
+
+/* ------------------------------------------------------------------ */
+/* Cross-worker mailboxes                                              */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Each worker owns a bounded MPSC ring (Vyukov style: a slot is free for
+ * position p when its seq == p and holds a message when seq == p + 1).
+ * Producers claim a position with a CAS on tail, the owning worker is the
+ * only consumer.
+ *
+ * 'notified' is set while the worker is awake or a wakeup is already on
+ * its way, so only the first upcall_post() after the worker goes to sleep
+ * writes the eventfd.  The worker clears it and drains the ring right
+ * before every upcall_submit.
+ */
+struct post_slot {
+	uint64_t	seq;
+	void		(*fn)(void *arg);
+	void		*arg;
+};
+
+/* An upcall_spawn() task; owned, allocated and freed by the spawning worker */
+struct upcall_task {
+	struct upcall_task	*next;		/* free list or owner's task_done */
+	void			(*fn)(void *arg);
+	void			(*done)(void *arg);
+	void			*arg;
+	struct upcall_worker	*owner;
+};
+
+struct upcall_worker {
+	uint64_t		post_tail __attribute__((aligned(64)));
+	int			notified;
+	int			wake_fd;
+	int			id;
+	struct upcall_ctx	*ctx;
+	struct upcall_stats	*stats;		/* the worker's wstats, then final */
+	uint64_t		post_head __attribute__((aligned(64)));
+	struct post_slot	slots[UPCALL_POST_RING];
+
+	/* Compute tasks, see the section of that name */
+	int64_t			task_top __attribute__((aligned(64)));
+	int64_t			task_bottom __attribute__((aligned(64)));
+	struct upcall_task	*tasks[UPCALL_TASK_DEQUE];
+	struct upcall_task	*task_done __attribute__((aligned(64)));
+	int			task_idle;
+
+#ifdef UPCALL_TRACE
+	struct TscLog		*trace;
+#endif
+
+	/* Only used when the pool is shut down */
+	pthread_t		tid;
+	bool			timed_out;
+	struct upcall_stats	final;
+	uint8_t			*arena;		/* unmapped once upfd is closed */
+	size_t			arena_sz;
+} __attribute__((aligned(64)));
+
+/*
+ * One pool of workers, with its own upfd, buffer size and CPUs.  Workers
+ * find theirs through tls_worker, so the callback-facing API needs no
+ * context argument.
+ */
+struct upcall_ctx {
+	int			upfd;
+	struct upcall_buf_class	classes[UPCALL_BUF_CLASSES];	/* by size */
+	int			nr_classes;
+	void			(*setup_fn)(int worker_id, int nr_workers);
+	void			(*loop_fn)(void);
+
+	struct upcall_worker	*workers;
+	int			nr_workers;
+	int			*worker_cpu;
+	int			cpu_worker[CPU_SETSIZE];
+
+	/* init barrier: the creator waits for all workers to complete setup_fn */
+	pthread_mutex_t		init_lock;
+	pthread_cond_t		init_cond;
+	int			init_count;
+
+	/* go barrier: workers wait for upcall_ctx_go() */
+	bool			go;
+	pthread_cond_t		go_cond;
+
+	/* set by upcall_ctx_fini(), deadline in CLOCK_MONOTONIC microseconds */
+	int			stop;
+	uint64_t		deadline;
+
+	/* busy polling, see upcall_ctx_set_spin() */
+	uint32_t		spin_us;
+	bool			spin_adaptive;
+
+	/* see upcall_ctx_set_dispatch_budget() */
+	uint64_t		dispatch_budget;
+
+	/* workers asleep with nothing to steal (task_idle set) */
+	int			tasks_idle;
+};
+
+/* The context created by upcall_init(), for the context-free API */
+static struct upcall_ctx *g_default_ctx;
+
+static __thread struct upcall_worker *tls_worker;
+
+/* Moving average of how long a reap waited for its first completion */
+static __thread uint64_t gap_ewma_ns;
+
+/*
+ * The pool the context-free calls act on: the caller's own when it is a
+ * worker, else the one upcall_init() created.
+ */
+static struct upcall_ctx *current_ctx(void)
+{
+	return tls_worker ? tls_worker->ctx : g_default_ctx;
+}
+
+static int mailbox_init(struct upcall_worker *w)
+{
+	w->post_tail = 0;
+	w->post_head = 0;
+	w->notified  = 0;
+	for (uint64_t i = 0; i < UPCALL_POST_RING; i++)
+		w->slots[i].seq = i;
+
+	w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->wake_fd < 0)
+		return -errno;
+	return 0;
+}
+
+static void mailbox_wake(struct up_event *evt)
+{
+	if (evt->buf)
+		return_buffer(evt->buf, evt->len);
+	add_read_hint(evt->fd, sizeof(uint64_t), mailbox_wake);
+}
+
+static bool mailbox_empty(struct upcall_worker *w)
+{
+	return __atomic_load_n(&w->post_tail, __ATOMIC_ACQUIRE) == w->post_head;
+}
+
+static void mailbox_drain(struct upcall_worker *w)
+{
+	struct post_slot *slot;
+	void (*fn)(void *arg);
+	void *arg;
+
+	__atomic_exchange_n(&w->notified, 0, __ATOMIC_ACQ_REL);
+
+	/* Bounded so a flood of self-posts cannot starve the kernel side */
+	for (int i = 0; i < UPCALL_POST_RING; i++) {
+		slot = &w->slots[w->post_head & (UPCALL_POST_RING - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != w->post_head + 1)
+			break;
+
+		fn  = slot->fn;
+		arg = slot->arg;
+		__atomic_store_n(&slot->seq, w->post_head + UPCALL_POST_RING,
+				 __ATOMIC_RELEASE);
+		w->post_head++;
+		fn(arg);
+	}
+}
+
+int upcall_ctx_post(struct upcall_ctx *ctx, int worker_id,
+		    void (*fn)(void *arg), void *arg)
+{
+	struct upcall_worker *w;
+	struct post_slot *slot;
+	uint64_t one = 1;
+	uint64_t pos;
+	int64_t diff;
+
+	if (!ctx || worker_id < 0 || worker_id >= ctx->nr_workers || !fn)
+		return -EINVAL;
+
+	w   = &ctx->workers[worker_id];
+	pos = __atomic_load_n(&w->post_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &w->slots[pos & (UPCALL_POST_RING - 1)];
+		diff = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+		       (int64_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&w->post_tail, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -EAGAIN;
+		} else {
+			pos = __atomic_load_n(&w->post_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->fn  = fn;
+	slot->arg = arg;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (!__atomic_exchange_n(&w->notified, 1, __ATOMIC_ACQ_REL)) {
+		if (write(w->wake_fd, &one, sizeof(one)) != sizeof(one))
+			perror("upcall_post wakeup");
+	}
+	return 0;
+}
+
+int upcall_post(int worker_id, void (*fn)(void *arg), void *arg)
+{
+	return upcall_ctx_post(current_ctx(), worker_id, fn, arg);
+}
+
+int upcall_ctx_stats(struct upcall_ctx *ctx, int worker_id,
+		     struct upcall_stats *out)
+{
+	const uint64_t *src;
+	uint64_t *dst = (uint64_t *)out;
+
+	if (!ctx || worker_id < 0 || worker_id >= ctx->nr_workers || !out)
+		return -EINVAL;
+
+	/* Published by the worker as it starts up */
+	src = (const uint64_t *)__atomic_load_n(&ctx->workers[worker_id].stats,
+						__ATOMIC_ACQUIRE);
+	if (!src)
+		return -EINVAL;
+
+	/* Every field is a uint64_t, so copy it as an array of them */
+	for (size_t i = 0; i < sizeof(*out) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	return 0;
+}
+
+int upcall_stats(int worker_id, struct upcall_stats *out)
+{
+	return upcall_ctx_stats(current_ctx(), worker_id, out);
+}
+
+#ifdef UPCALL_TRACE
+static const char *trace_phase_name[] = {
+	[UPCALL_TRACE_SUBMIT]		= "SUBMIT",
+	[UPCALL_TRACE_SUBMIT_DONE]	= "SUBMIT_DONE",
+	[UPCALL_TRACE_CALLBACK]		= "CALLBACK",
+	[UPCALL_TRACE_CALLBACK_DONE]	= "CALLBACK_DONE",
+	[UPCALL_TRACE_LOOP_FN]		= "LOOP_FN",
+	[UPCALL_TRACE_LOOP_FN_DONE]	= "LOOP_FN_DONE",
+};
+
+/* Allocate a log the way tcp_client does, aligned to a cache line */
+static struct TscLog *trace_alloc(void)
+{
+	size_t entry_size = TscLogEntrySize(4) * (size_t)UPCALL_TRACE_ENTRIES;
+	struct TscLog *log;
+
+	log = aligned_alloc(L1_CACHE_BYTES, sizeof(struct TscLog) + entry_size);
+	if (!log) {
+		perror("OOM");
+		exit(1);
+	}
+
+	log->hdr.info.cur = &log->entries[0];
+	log->hdr.info.end = (uint8_t *)log->hdr.info.cur + entry_size;
+	log->hdr.info.overflow = 0;
+	log->hdr.info.valperentry = 4;
+	return log;
+}
+
+int upcall_ctx_trace_dump(struct upcall_ctx *ctx, int fd)
+{
+	struct TscLogEntry *cursor, *end;
+	struct TscLog *log;
+
+	if (!ctx || fd < 0)
+		return -EINVAL;
+
+	if (dprintf(fd, "WORKER\tCPU\tTSC\tPHASE\tA\tB\tC\n") < 0)
+		return -errno;
+
+	for (int i = 0; i < ctx->nr_workers; i++) {
+		log = ctx->workers[i].trace;
+		if (!log)
+			continue;
+
+		cursor = (struct TscLogEntry *)&log->entries[0];
+		end    = __atomic_load_n(&log->hdr.info.cur, __ATOMIC_ACQUIRE);
+		while (cursor < end) {
+			/* rdtscp's TSC_AUX holds the node above the CPU number */
+			if (dprintf(fd, "%d\t%u\t%lu\t%s\t%lu\t%lu\t%lu\n", i,
+				    cursor->cpu & 0xfff, cursor->tsc,
+				    trace_phase_name[cursor->values[0]],
+				    cursor->values[1], cursor->values[2],
+				    cursor->values[3]) < 0)
+				return -errno;
+			cursor = (struct TscLogEntry *)((uint8_t *)cursor + TscLogEntrySize(4));
+		}
+		if (log->hdr.info.overflow)
+			dprintf(fd, "# worker %d: trace full, later events dropped\n", i);
+	}
+	return 0;
+}
+#else
+int upcall_ctx_trace_dump(struct upcall_ctx *ctx, int fd)
+{
+	return -ENOTSUP;
+}
+#endif
+
+int upcall_trace_dump(int fd)
+{
+	return upcall_ctx_trace_dump(current_ctx(), fd);
+}
+
+/* ------------------------------------------------------------------ */
+/* Compute tasks                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * upcall_spawn() pushes onto the spawning worker's Chase-Lev deque (Lê,
+ * Pop, Cohen and Zappa Nardelli's C11 formulation, with a fixed ring in
+ * place of a growable array).  The owner pops from the bottom after each
+ * batch of callbacks, for at most UPCALL_TASK_SLICE_US before it goes
+ * back to its I/O without waiting.  A worker about to sleep in
+ * upcall_submit first takes tasks from the top of the other workers'
+ * deques, and only sleeps once there are none.
+ *
+ * Only fn runs on the thief.  The task then goes onto its owner's
+ * task_done stack and done runs on the owner, so every add_*() a task
+ * leads to is queued where the connection lives.  A thief wakes the owner
+ * the way upcall_post() does; a spawner wakes one idle worker when any
+ * are asleep (task_idle and tasks_idle, set before the sleeper's last
+ * look at the deques so a push can't slip in between unseen).
+ */
+static __thread struct upcall_task *task_cache;
+static __thread int tasks_pending;	/* spawned here, done() not yet run */
+static __thread int steal_next;		/* where the next steal starts looking */
+
+static void tasks_init(struct upcall_worker *w)
+{
+	w->task_top    = 0;
+	w->task_bottom = 0;
+	w->task_done   = NULL;
+	w->task_idle   = 0;
+}
+
+static inline bool deque_empty(struct upcall_worker *w)
+{
+	return __atomic_load_n(&w->task_top, __ATOMIC_ACQUIRE) >=
+	       __atomic_load_n(&w->task_bottom, __ATOMIC_ACQUIRE);
+}
+
+static bool deque_push(struct upcall_worker *w, struct upcall_task *t)
+{
+	int64_t b   = __atomic_load_n(&w->task_bottom, __ATOMIC_RELAXED);
+	int64_t top = __atomic_load_n(&w->task_top, __ATOMIC_ACQUIRE);
+
+	if (b - top >= UPCALL_TASK_DEQUE)
+		return false;
+
+	__atomic_store_n(&w->tasks[b & (UPCALL_TASK_DEQUE - 1)], t,
+			 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&w->task_bottom, b + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Owner only */
+static struct upcall_task *deque_pop(struct upcall_worker *w)
+{
+	int64_t b = __atomic_load_n(&w->task_bottom, __ATOMIC_RELAXED) - 1;
+	struct upcall_task *t = NULL;
+	int64_t top;
+
+	__atomic_store_n(&w->task_bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&w->task_top, __ATOMIC_RELAXED);
+
+	if (top <= b) {
+		t = __atomic_load_n(&w->tasks[b & (UPCALL_TASK_DEQUE - 1)],
+				    __ATOMIC_RELAXED);
+		if (top != b)
+			return t;
+		/* Last one: race any thief for it */
+		if (!__atomic_compare_exchange_n(&w->task_top, &top, top + 1,
+						 false, __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			t = NULL;
+	}
+	__atomic_store_n(&w->task_bottom, b + 1, __ATOMIC_RELAXED);
+	return t;
+}
+
+/* Any thread; NULL if empty or another thief got there first */
+static struct upcall_task *deque_steal(struct upcall_worker *w)
+{
+	int64_t top = __atomic_load_n(&w->task_top, __ATOMIC_ACQUIRE);
+	struct upcall_task *t;
+	int64_t b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->task_bottom, __ATOMIC_ACQUIRE);
+	if (top >= b)
+		return NULL;
+
+	t = __atomic_load_n(&w->tasks[top & (UPCALL_TASK_DEQUE - 1)],
+			    __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->task_top, &top, top + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return t;
+}
+
+static void task_exec(struct upcall_task *t)
+{
+	uint64_t start = upcall_cycles();
+
+	t->fn(t->arg);
+	STAT_ADD(task_cycles, upcall_cycles() - start);
+}
+
+/* On the owner: run done and recycle the task */
+static void task_finish(struct upcall_task *t)
+{
+	if (t->done)
+		t->done(t->arg);
+	t->next    = task_cache;
+	task_cache = t;
+	tasks_pending--;
+}
+
+/* Give a stolen task back to its owner for task_finish() */
+static void task_return(struct upcall_task *t)
+{
+	struct upcall_worker *owner = t->owner;
+	uint64_t one = 1;
+
+	t->next = __atomic_load_n(&owner->task_done, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&owner->task_done, &t->next, t, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	if (!__atomic_exchange_n(&owner->notified, 1, __ATOMIC_ACQ_REL)) {
+		if (write(owner->wake_fd, &one, sizeof(one)) != sizeof(one))
+			perror("upcall task wakeup");
+	}
+}
+
+/* Finish the tasks other workers have run for us; called after mailbox_drain */
+static void tasks_finish(struct upcall_worker *w)
+{
+	struct upcall_task *t, *next;
+
+	if (!__atomic_load_n(&w->task_done, __ATOMIC_RELAXED))
+		return;
+
+	t = __atomic_exchange_n(&w->task_done, NULL, __ATOMIC_ACQUIRE);
+	for (; t; t = next) {
+		next = t->next;
+		task_finish(t);
+	}
+}
+
+/*
+ * Run our own tasks.  With no way to submit without waiting, the worker
+ * cannot come back to them after the submit, so it runs them all.
+ */
+static void tasks_run(struct upcall_worker *w)
+{
+	uint64_t start;
+	struct upcall_task *t;
+
+	if (deque_empty(w))
+		return;
+
+	start = now_ns();
+	while ((t = deque_pop(w))) {
+		task_exec(t);
+		task_finish(t);
+		if (backend->submit_nowait &&
+		    now_ns() - start >= UPCALL_TASK_SLICE_US * 1000ULL)
+			break;
+	}
+}
+
+/* Run one task from another worker's deque, false if there were none */
+static bool task_steal(struct upcall_worker *w)
+{
+	struct upcall_ctx *ctx = w->ctx;
+	struct upcall_worker *victim;
+	struct upcall_task *t;
+
+	for (int i = 0; i < ctx->nr_workers; i++) {
+		victim = &ctx->workers[(steal_next + i) % ctx->nr_workers];
+		if (victim == w)
+			continue;
+
+		t = deque_steal(victim);
+		if (!t)
+			continue;
+
+		steal_next = victim->id;
+		task_exec(t);
+		STAT_ADD(tasks_stolen, 1);
+		task_return(t);
+		return true;
+	}
+	return false;
+}
+
+static bool tasks_queued(struct upcall_ctx *ctx, struct upcall_worker *self)
+{
+	for (int i = 0; i < ctx->nr_workers; i++) {
+		if (&ctx->workers[i] != self && !deque_empty(&ctx->workers[i]))
+			return true;
+	}
+	return false;
+}
+
+static void task_set_idle(struct upcall_worker *w, bool idle)
+{
+	if (idle) {
+		__atomic_store_n(&w->task_idle, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&w->ctx->tasks_idle, 1, __ATOMIC_SEQ_CST);
+	} else if (__atomic_exchange_n(&w->task_idle, 0, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&w->ctx->tasks_idle, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/* A task was just pushed on w: get a sleeping worker to come and take it */
+static void task_wake_idle(struct upcall_worker *w)
+{
+	struct upcall_ctx *ctx = w->ctx;
+	struct upcall_worker *other;
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ctx->tasks_idle, __ATOMIC_RELAXED) <= 0)
+		return;
+
+	for (int i = 1; i < ctx->nr_workers; i++) {
+		other = &ctx->workers[(w->id + i) % ctx->nr_workers];
+		if (!__atomic_load_n(&other->task_idle, __ATOMIC_RELAXED) ||
+		    !__atomic_exchange_n(&other->task_idle, 0, __ATOMIC_SEQ_CST))
+			continue;
+
+		__atomic_sub_fetch(&ctx->tasks_idle, 1, __ATOMIC_SEQ_CST);
+		if (write(other->wake_fd, &one, sizeof(one)) != sizeof(one))
+			perror("upcall task wakeup");
+		return;
+	}
+}
+
+int upcall_spawn(void (*fn)(void *arg), void (*done)(void *arg), void *arg)
+{
+	struct upcall_worker *w = tls_worker;
+	struct upcall_task *t;
+
+	if (!w || !fn)
+		return -EINVAL;
+
+	t = task_cache;
+	if (t) {
+		task_cache = t->next;
+	} else {
+		t = malloc(sizeof(struct upcall_task));
+		if (!t) {
+			perror("OOM");
+			exit(1);
+		}
+	}
+
+	t->fn    = fn;
+	t->done  = done;
+	t->arg   = arg;
+	t->owner = w;
+	tasks_pending++;
+	STAT_ADD(tasks_spawned, 1);
+
+	/* No room to share it: it is ours to run anyway */
+	if (!deque_push(w, t)) {
+		task_exec(t);
+		task_finish(t);
+		return 0;
+	}
+
+	task_wake_idle(w);
+	return 0;
+}
+
+/* Free the task cache; tasks a deadline cut off are not ours to free */
+static void tasks_teardown(void)
+{
+	struct upcall_task *t;
+
+	while ((t = task_cache)) {
+		task_cache = t->next;
+		free(t);
+	}
+	tasks_pending = 0;
+	steal_next    = 0;
+}
+
+/*
+ * Bookkeeping ahead of a completion's callback.  Every completion that
+ * ends its registration is flagged UP_F_LAST.  Returns false for one that
+ * is dealt with here and not delivered.
+ */
+static inline bool dispatch_prepare(struct up_event *evt)
+{
+	if (evt->type == UP_READ) {
+		if (evt->buf)
+			pool_taken(evt->buf, evt->len);
+		else if (evt->result == -ENOMEM)
+			STAT_ADD(pool_underflows, 1);
+	} else if (is_write(evt->type)) {
+		writes_inflight--;
+	} else if (evt->type == UP_ACCEPT && draining) {
+		/* Too late for this one, and the registration is not renewed */
+		if (evt->result >= 0)
+			close(evt->result);
+		return false;
+	}
+
+	if (up_event_final(evt))
+		evt->flags |= UP_F_LAST;
+	return true;
+}
+
+/*
+ * Backends without native multishot support get live multishot
+ * registrations re-armed once the callback returns, from armed, the
+ * completion as it was before the callback saw it.  A poll's len is its
+ * events.  A read's is its size hint, or the size of the buffer it was
+ * given, which asks for that buffer's class again.
+ */
+static inline void dispatch_rearm(const struct up_event *armed)
+{
+	if (backend->multishot || up_event_final(armed))
+		return;
+
+	/* The callback cancelled it: this ends the registration instead */
+	if (rearm_cancels_cnt && rearm_cancelled(armed)) {
+		local_complete(armed->fd, armed->type, NULL, 0, armed->work_fn,
+			       armed->flags, armed->user_data, -ECANCELED);
+		return;
+	}
+
+	queue_action_data(armed->fd, armed->type, NULL,
+			  armed->type == UP_ACCEPT ? 0 : armed->len,
+			  armed->work_fn, armed->flags & UP_F_MULTISHOT,
+			  armed->user_data);
+}
+
+/* Deliver one completion */
+static inline void dispatch(struct up_event *evt)
+{
+	struct up_event armed = *evt;
+
+	if (!dispatch_prepare(evt))
+		return;
+
+	rearm_cancels_cnt = 0;
+	TRACE(UPCALL_TRACE_CALLBACK, armed.fd, armed.type, evt->result);
+	evt->work_fn(evt);
+	TRACE(UPCALL_TRACE_CALLBACK_DONE, armed.fd, armed.type, 0);
+
+	dispatch_rearm(&armed);
+}
+
+/*
+ * Deliver the local completions queued so far.  Ones their callbacks queue
+ * wait for the next round, which then does not wait in the backend.
+ */
+static void local_run(void)
+{
+	struct up_event evt;
+	int n = local_cnt;
+
+	if (!n)
+		return;
+
+	for (int i = 0; i < n; i++) {
+		evt = local[i];
+		dispatch(&evt);
+	}
+	local_cnt -= n;
+	memmove(local, &local[n], local_cnt * sizeof(struct up_event));
+}
+
+/* ------------------------------------------------------------------ */
+/* Batch dispatch                                                      */
+/* ------------------------------------------------------------------ */
+
+/*
+ * A worker's upcall_batch_handler() registrations.  With none, the event
+ * loop dispatches exactly as before; with some, each completion's work_fn
+ * is looked up in this short table first.
+ */
+struct batch_handler {
+	void	(*work_fn)(struct up_event *evt);
+	void	(*batch_fn)(struct up_event *evts, int cnt);
+};
+
+static __thread struct batch_handler batch_handlers[UPCALL_BATCH_HANDLERS];
+static __thread int nr_batch_handlers;
+static __thread struct up_event *batch_evts;	/* what batch_fn is given */
+static __thread struct up_event *batch_armed;	/* ... as dispatch_rearm needs it */
+
+int upcall_batch_handler(void (*work_fn)(struct up_event *evt),
+			 void (*batch_fn)(struct up_event *evts, int cnt))
+{
+	int i;
+
+	if (!tls_worker || !work_fn)
+		return -EINVAL;
+
+	for (i = 0; i < nr_batch_handlers; i++)
+		if (batch_handlers[i].work_fn == work_fn)
+			break;
+
+	if (!batch_fn) {
+		if (i < nr_batch_handlers)
+			batch_handlers[i] = batch_handlers[--nr_batch_handlers];
+		return 0;
+	}
+
+	if (i == nr_batch_handlers) {
+		if (i == UPCALL_BATCH_HANDLERS)
+			return -ENOSPC;
+		nr_batch_handlers++;
+	}
+	batch_handlers[i].work_fn  = work_fn;
+	batch_handlers[i].batch_fn = batch_fn;
+
+	if (!batch_evts) {
+		batch_evts  = calloc(2 * recv_cnt, sizeof(struct up_event));
+		batch_armed = calloc(2 * recv_cnt, sizeof(struct up_event));
+		if (!batch_evts || !batch_armed) {
+			perror("OOM");
+			exit(1);
+		}
+	}
+	return 0;
+}
+
+static inline const struct batch_handler *
+batch_lookup(void (*work_fn)(struct up_event *evt))
+{
+	for (int i = 0; i < nr_batch_handlers; i++)
+		if (batch_handlers[i].work_fn == work_fn)
+			return &batch_handlers[i];
+	return NULL;
+}
+
+/*
+ * Deliver every completion left in the batch for h's work_fn in one call
+ * to its batch_fn, in the order they were reaped.  They leave receive[]
+ * first, so a cancel or close from batch_fn only scrubs what is still to
+ * come for other handlers.
+ */
+static void dispatch_batch(const struct batch_handler *h)
+{
+	void (*work_fn)(struct up_event *evt) = h->work_fn;
+	void (*batch_fn)(struct up_event *evts, int cnt) = h->batch_fn;
+	struct up_event *evt;
+	int kept = recv_next;
+	int n = 0;
+
+	for (int i = recv_next; i < recv_end; i++) {
+		evt = &receive[i];
+		if (evt->work_fn != work_fn) {
+			receive[kept++] = *evt;
+			continue;
+		}
+		batch_armed[n] = *evt;
+		if (dispatch_prepare(evt))
+			batch_evts[n++] = *evt;
+	}
+	recv_end = kept;
+	if (!n)
+		return;
+
+	STAT_ADD(batches, 1);
+	STAT_ADD(batched, n);
+	rearm_cancels_cnt = 0;
+	TRACE(UPCALL_TRACE_CALLBACK, -1, batch_evts[0].type, n);
+	batch_fn(batch_evts, n);
+	TRACE(UPCALL_TRACE_CALLBACK_DONE, -1, batch_evts[0].type, 0);
+
+	for (int i = 0; i < n; i++)
+		dispatch_rearm(&batch_armed[i]);
+}
+
+/*
+ * Everything reaped by the last submit, handler batches included, after
+ * whatever an earlier call put off.  Once budget cycles have gone since
+ * start, what is left waits at the front of receive[] for the next round,
+ * so the actions queued so far go out without waiting for slow callbacks.
+ * At least one completion is delivered each time, and no more than a
+ * submit's worth are held back.  cancel_reaped() sees the held ones too.
+ */
+static void dispatch_all(uint64_t budget, uint64_t start)
+{
+	const struct batch_handler *h;
+	int delivered = 0;	/* batches leave recv_next where it was */
+
+	for (recv_next = 0; recv_next < recv_end; delivered++) {
+		if (budget && delivered && recv_end - recv_next <= recv_cnt &&
+		    upcall_cycles() - start >= budget) {
+			recv_held = recv_end - recv_next;
+			memmove(receive, &receive[recv_next],
+				recv_held * sizeof(struct up_event));
+			STAT_ADD(deferrals, 1);
+			STAT_ADD(deferred, recv_held);
+			recv_next = 0;
+			recv_end  = recv_held;
+			return;
+		}
+
+		h = nr_batch_handlers ? batch_lookup(receive[recv_next].work_fn) : NULL;
+		if (h)
+			dispatch_batch(h);
+		else
+			dispatch(&receive[recv_next++]);
+	}
+	recv_held = recv_next = recv_end = 0;
+}
+
+/* One upcall_submit of everything queued so far */
+static int submit_batch(int upfd, bool wait)
+{
+	int ret;
+
+	if (wait)
+		ret = upcall_submit(upfd, work_cnt, work, recv_cnt,
+				    &receive[recv_held]);
+	else
+		ret = backend->submit_nowait(upfd, work_cnt, work, recv_cnt,
+					     &receive[recv_held]);
+	if (ret < 0) {
+		perror("upcall_submit failed");
+		exit(1);
+	}
+	STAT_ADD(submits, 1);
+
+	/* Input actions libupcall cancelled after they went out */
+	if (backend->cancel) {
+		for (int i = recv_held; i < recv_held + ret; i++) {
+			if (receive[i].flags & UP_F_CANCELED) {
+				receive[i].flags &= ~UP_F_CANCELED;
+				cancel_input(&receive[i]);
+			}
+		}
+	}
+
+	for (int c = 0; c < nr_pool_classes; c++)
+		pool_classes[c].buf_cnt = 0;
+	work_cnt = 0;
+	return ret;
+}
+
+/*
+ * Wait for completions, but first run whatever tasks other workers have
+ * queued.  Without a submit that can come back empty, a steal costs a
+ * round instead (see run_event_loop()), and the worker only sleeps as
+ * idle so the next task pushed wakes it.  A draining worker leaves tasks
+ * to their owners.
+ */
+static int submit_wait(struct upcall_worker *w, int upfd)
+{
+	int ret;
+
+	if (draining)
+		return submit_batch(upfd, true);
+
+	if (!backend->submit_nowait) {
+		task_set_idle(w, true);
+		ret = submit_batch(upfd, true);
+		task_set_idle(w, false);
+		return ret;
+	}
+
+	for (;;) {
+		if (task_steal(w)) {
+			ret = submit_batch(upfd, false);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		task_set_idle(w, true);
+		if (!tasks_queued(w->ctx, w))
+			break;
+		task_set_idle(w, false);
+	}
+
+	ret = submit_batch(upfd, true);
+	task_set_idle(w, false);
+	return ret;
+}
+
+/*
+ * Is there work of our own, tasks, deferred or local completions, that a
+ * blocking submit would leave waiting on unrelated I/O?
+ */
+static inline bool work_pending(struct upcall_worker *w)
+{
+	return recv_held || local_cnt || !deque_empty(w);
+}
+
+/*
+ * Submit and collect completions.  With a spin budget the worker polls
+ * without blocking for up to that long before it sleeps in the backend.
+ * Adaptive spinning skips the polling while the recent wait for a first
+ * completion, an EWMA over 8 reaps, is longer than the budget, since the
+ * spin would then rarely pay off.
+ */
+static int reap_events(struct upcall_worker *w, int upfd)
+{
+	struct upcall_ctx *ctx = w->ctx;
+	uint64_t budget = (uint64_t)__atomic_load_n(&ctx->spin_us, __ATOMIC_RELAXED) * 1000;
+	uint64_t start, spin;
+	int ret;
+
+	/* Take what is ready and get back to our own work */
+	if (backend->submit_nowait && work_pending(w))
+		return submit_batch(upfd, false);
+
+	if (!budget || !backend->submit_nowait)
+		return submit_wait(w, upfd);
+
+	start = now_ns();
+	if (__atomic_load_n(&ctx->spin_adaptive, __ATOMIC_RELAXED) &&
+	    gap_ewma_ns > budget) {
+		ret = submit_wait(w, upfd);
+		STAT_ADD(sleeps, 1);
+		goto out;
+	}
+
+	spin = upcall_cycles();
+	STAT_ADD(spins, 1);
+	do {
+		ret = submit_batch(upfd, false);
+	} while (!ret && now_ns() - start < budget);
+	STAT_ADD(spin_cycles, upcall_cycles() - spin);
+
+	if (ret)
+		STAT_ADD(spin_hits, 1);
+	else {
+		ret = submit_wait(w, upfd);
+		STAT_ADD(sleeps, 1);
+	}
+out:
+	gap_ewma_ns += ((int64_t)(now_ns() - start) - (int64_t)gap_ewma_ns) / 8;
+	return ret;
+}
+
+/* Set when the last round ran its own work in place of a submit */
+static __thread bool submit_skipped;
+
+static void run_event_loop(int upfd, int continuous)
+{
+	struct upcall_worker *w = tls_worker;
+	uint64_t start, submit, reap, budget;
+	int ret;
+
+	do {
+		start = upcall_cycles();
+		mailbox_drain(w);
+		tasks_finish(w);
+		timers_run();
+		local_run();
+		timers_arm();
+		/* Cancels since the last round may have taken some back */
+		recv_held = recv_end;
+
+		/*
+		 * A backend that cannot submit without waiting would hold our
+		 * own pending work, or a task another worker could use help
+		 * with, up behind unrelated I/O, so run it first and leave
+		 * what is queued for the next round.  Every other round at
+		 * most, so the I/O is never starved in turn.
+		 */
+		if (!backend->submit_nowait && !submit_skipped &&
+		    (work_pending(w) || (!draining && task_steal(w)))) {
+			submit_skipped = true;
+			ret = 0;
+			submit = reap = upcall_cycles();
+		} else {
+			submit_skipped = false;
+			pool_refill();
+			if ((uint64_t)work_cnt > wstats.work_hwm)
+				STAT_SET(work_hwm, work_cnt);
+
+			TRACE(UPCALL_TRACE_SUBMIT, work_cnt, 0, 0);
+			submit = upcall_cycles();
+			ret = reap_events(w, upfd);
+			reap = upcall_cycles();
+			TRACE(UPCALL_TRACE_SUBMIT_DONE, ret, 0, 0);
+			STAT_ADD(submit_cycles, reap - submit);
+			STAT_ADD(completions, ret);
+			STAT_ADD(batch_hist[batch_bucket(ret)], 1);
+		}
+
+		/* Awake until the next drain, posters need not wake us */
+		__atomic_store_n(&w->notified, 1, __ATOMIC_RELEASE);
+
+		/* add_cancel()/add_close() may shrink the batch as it runs */
+		recv_end = recv_held + ret;
+		budget   = backend->submit_nowait ?
+			   __atomic_load_n(&w->ctx->dispatch_budget, __ATOMIC_RELAXED) : 0;
+		dispatch_all(budget, reap);
+		memset(&receive[recv_held], 0,
+		       (2 * recv_cnt - recv_held) * sizeof(struct up_event));
+		STAT_ADD(callback_cycles, (submit - start) + (upcall_cycles() - reap));
+
+		tasks_run(w);
+	} while (continuous);
+}
+
+/* ------------------------------------------------------------------ */
+/* Worker placement                                                    */
+/* ------------------------------------------------------------------ */
+
+struct cpu_place {
+	int	cpu;
+	int	smt;		/* SMT siblings with a lower CPU id */
+	int	package;
+	int	core;
+};
+
+static int sysfs_topology(int cpu, const char *attr, char *buf, size_t len)
+{
+	char path[128];
+	FILE *f;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+		 cpu, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, len, f))
+		ret = -1;
+	fclose(f);
+	return ret;
+}
+
+static int topology_int(int cpu, const char *attr, int dflt)
+{
+	char buf[32];
+
+	if (sysfs_topology(cpu, attr, buf, sizeof(buf)))
+		return dflt;
+	return atoi(buf);
+}
+
+/* Count the entries below cpu in its thread_siblings_list ("0,64", "0-3") */
+static int siblings_below(int cpu)
+{
+	char buf[256];
+	char *p = buf;
+	long lo, hi;
+	int below = 0;
+
+	if (sysfs_topology(cpu, "thread_siblings_list", buf, sizeof(buf)))
+		return 0;
+
+	for (;;) {
+		lo = hi = strtol(p, &p, 10);
+		if (*p == '-')
+			hi = strtol(p + 1, &p, 10);
+		for (long c = lo; c <= hi && c < cpu; c++)
+			below++;
+		if (*p != ',')
+			break;
+		p++;
+	}
+	return below;
+}
+
+/* First thread of every core before any sibling, then by package and core */
+static int place_cmp(const void *a, const void *b)
+{
+	const struct cpu_place *x = a, *y = b;
+
+	if (x->smt != y->smt)
+		return x->smt - y->smt;
+	if (x->package != y->package)
+		return x->package - y->package;
+	if (x->core != y->core)
+		return x->core - y->core;
+	return x->cpu - y->cpu;
+}
+
+/*
+ * The CPUs workers may run on: our affinity mask (which only holds online
+ * CPUs and honours any cpuset we were started in), narrowed to cpus when
+ * the caller gave one.
+ */
+static int usable_cpus(const cpu_set_t *cpus, cpu_set_t *out)
+{
+	if (sched_getaffinity(0, sizeof(*out), out))
+		return -errno;
+	if (cpus)
+		CPU_AND(out, out, cpus);
+	return CPU_COUNT(out) ? 0 : -EINVAL;
+}
+
+/* Fill ctx->worker_cpu/cpu_worker and return the number of workers */
+static int place_workers(struct upcall_ctx *ctx, const cpu_set_t *cpus)
+{
+	struct cpu_place *place;
+	cpu_set_t allowed;
+	int nr, i = 0;
+	int ret;
+
+	ret = usable_cpus(cpus, &allowed);
+	if (ret)
+		return ret;
+
+	nr    = CPU_COUNT(&allowed);
+	place = calloc(nr, sizeof(struct cpu_place));
+	ctx->worker_cpu = calloc(nr, sizeof(int));
+	if (!place || !ctx->worker_cpu) {
+		free(place);
+		return -ENOMEM;
+	}
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		place[i].cpu     = cpu;
+		place[i].smt     = siblings_below(cpu);
+		place[i].package = topology_int(cpu, "physical_package_id", 0);
+		place[i].core    = topology_int(cpu, "core_id", cpu);
+		i++;
+	}
+	qsort(place, nr, sizeof(struct cpu_place), place_cmp);
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		ctx->cpu_worker[cpu] = -1;
+	for (i = 0; i < nr; i++) {
+		ctx->worker_cpu[i] = place[i].cpu;
+		ctx->cpu_worker[place[i].cpu] = i;
+	}
+
+	free(place);
+	return nr;
+}
+
+int upcall_ctx_nr_workers(struct upcall_ctx *ctx)
+{
+	return ctx->nr_workers;
+}
+
+int upcall_nr_workers(void)
+{
+	struct upcall_ctx *ctx = current_ctx();
+	cpu_set_t allowed;
+
+	if (ctx)
+		return ctx->nr_workers;
+	if (usable_cpus(NULL, &allowed))
+		return 0;
+	return CPU_COUNT(&allowed);
+}
+
+int upcall_ctx_worker_cpu(struct upcall_ctx *ctx, int worker_id)
+{
+	if (!ctx || worker_id < 0 || worker_id >= ctx->nr_workers)
+		return -1;
+	return ctx->worker_cpu[worker_id];
+}
+
+int upcall_worker_cpu(int worker_id)
+{
+	return upcall_ctx_worker_cpu(current_ctx(), worker_id);
+}
+
+int upcall_ctx_cpu_worker(struct upcall_ctx *ctx, int cpu)
+{
+	if (!ctx || cpu < 0 || cpu >= CPU_SETSIZE)
+		return -1;
+	return ctx->cpu_worker[cpu];
+}
+
+int upcall_cpu_worker(int cpu)
+{
+	return upcall_ctx_cpu_worker(current_ctx(), cpu);
+}
+
+/* ------------------------------------------------------------------ */
+/* Managed worker pool                                                 */
+/* ------------------------------------------------------------------ */
+
+size_t upcall_buf_sz(void)
+{
+	struct upcall_ctx *ctx = current_ctx();
+
+	return ctx ? ctx->classes[ctx->nr_classes - 1].size : 0;
+}
+
+int upcall_worker_id(void)
+{
+	return tls_worker ? tls_worker->id : -1;
+}
+
+struct upcall_ctx *upcall_ctx_self(void)
+{
+	return tls_worker ? tls_worker->ctx : NULL;
+}
+
+const char *upcall_backend_name(void)
+{
+	backend_setup();
+	return backend->name;
+}
+
+bool upcall_backend_has(up_action_t type)
+{
+	backend_setup();
+
+	switch (type) {
+	case UP_WRITEV:
+	case UP_TIMEOUT:
+	case UP_CLOSE:
+	case UP_SHUTDOWN:
+	case UP_CANCEL:
+		return true;
+	default:
+		return (unsigned int)type < NR_ACTIONS &&
+		       (backend->actions & UP_ACTION(type));
+	}
+}
+
+static uint64_t now_us(void)
+{
+	return now_ns() / 1000;
+}
+
+static __thread struct upcall_timer drain_timer;
+
+static void drain_expired(struct up_event *evt)
+{
+	/* Nothing to do, the wakeup is the point */
+}
+
+/*
+ * Checked between rounds.  Once upcall_ctx_fini() has asked the pool to
+ * stop, the worker takes no more connections and keeps going until it
+ * has no writes queued or in flight, no posts left to run and no tasks
+ * whose done() has yet to run, or until
+ * the deadline, which a timer makes sure it is awake for.
+ */
+static bool worker_stopped(struct upcall_worker *w)
+{
+	struct upcall_ctx *ctx = w->ctx;
+	uint64_t now;
+
+	if (!__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE))
+		return false;
+
+	now = now_us();
+	if (!draining) {
+		draining = true;
+		if (ctx->deadline > now)
+			add_timer(&drain_timer, ctx->deadline - now,
+				  drain_expired, NULL);
+	}
+
+	if (!writes_inflight && !tasks_pending && mailbox_empty(w))
+		return true;
+	if (now >= ctx->deadline) {
+		w->timed_out = true;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Free everything upcall_worker_setup() and the event loop allocated,
+ * except the pool arena: the backend may still be filling buffers it was
+ * given until the upfd is closed, so that is left to whoever closes it.
+ */
+static void upcall_worker_teardown(struct upcall_worker *w)
+{
+	timers_teardown();
+	tasks_teardown();
+	if (backend->release)
+		backend->release();
+
+	for (int i = 0; i < writevs_max; i++)
+		free(writevs[i].iov);
+	free(writevs);
+	writevs     = NULL;
+	writevs_max = 0;
+
+	w->arena    = arena;
+	w->arena_sz = arena_sz;
+	arena    = NULL;
+	arena_sz = 0;
+
+	for (int c = 0; c < nr_pool_classes; c++) {
+		free(pool_classes[c].buffers);
+		free(pool_classes[c].spares);
+		free(pool_classes[c].reserve);
+	}
+	memset(pool_classes, 0, sizeof(pool_classes));
+	nr_pool_classes = 0;
+
+	free(work);
+	free(receive);
+	work     = NULL;
+	receive  = NULL;
+	work_cnt = 0;
+	recv_held = recv_next = recv_end = 0;
+
+	free(local);
+	local     = NULL;
+	local_cnt = local_max = 0;
+
+	free(rearm_cancels);
+	rearm_cancels     = NULL;
+	rearm_cancels_cnt = rearm_cancels_max = 0;
+
+	free(batch_evts);
+	free(batch_armed);
+	batch_evts        = NULL;
+	batch_armed       = NULL;
+	nr_batch_handlers = 0;
+
+	draining        = false;
+	writes_inflight = 0;
+	submit_skipped  = false;
+}
+
+/* Only once the pool's upfd is closed */
+static void workers_unmap(struct upcall_ctx *ctx, int nr)
+{
 	for (int i = 0; i < nr; i++) {
+		if (ctx->workers[i].arena)
+			munmap(ctx->workers[i].arena, ctx->workers[i].arena_sz);
+	}
+}
+
+static void *upcall_worker_fn(void *arg)
+{
+	struct upcall_worker *w = arg;
+	struct upcall_ctx *ctx = w->ctx;
+
+	tls_worker = w;
+	__atomic_store_n(&w->stats, &wstats, __ATOMIC_RELEASE);
+#ifdef UPCALL_TRACE
+	trace_log = w->trace;
+#endif
+
+	upcall_worker_setup(ctx->upfd, ctx->classes, ctx->nr_classes);
+	add_read_hint(w->wake_fd, sizeof(uint64_t), mailbox_wake);
+	timers_setup();
+
+	if (ctx->setup_fn)
+		ctx->setup_fn(w->id, ctx->nr_workers);
+
+	/* Signal setup done, then wait for upcall_ctx_go */
+	pthread_mutex_lock(&ctx->init_lock);
+	ctx->init_count++;
+	pthread_cond_signal(&ctx->init_cond);
+	while (!ctx->go)
+		pthread_cond_wait(&ctx->go_cond, &ctx->init_lock);
+	pthread_mutex_unlock(&ctx->init_lock);
+
+	while (!worker_stopped(w)) {
+		run_event_loop(ctx->upfd, false);
+		if (ctx->loop_fn) {
+			TRACE(UPCALL_TRACE_LOOP_FN, 0, 0, 0);
+			ctx->loop_fn();
+			TRACE(UPCALL_TRACE_LOOP_FN_DONE, 0, 0, 0);
+		}
+	}
+
+	/* wstats dies with this thread, leave the totals with the pool */
+	w->final = wstats;
+	__atomic_store_n(&w->stats, &w->final, __ATOMIC_RELEASE);
+
+	upcall_worker_teardown(w);
+	tls_worker = NULL;
+	return NULL;
+}
+
+int upcall_ctx_init_classes(struct upcall_ctx **ctxp, const cpu_set_t *cpus,
+			    const struct upcall_buf_class *classes,
+			    int nr_classes,
+			    void (*setup_fn)(int worker_id, int nr_workers),
+			    void (*loop_fn)(void))
+{
+	struct upcall_buf_class sorted[UPCALL_BUF_CLASSES];
+	struct upcall_buf_class tmp;
+	struct upcall_ctx *ctx;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	const char *spin_env, *budget_env;
+	int inited, started;
+	int nr;
+	int ret;
+
+	if (!classes || nr_classes < 1 || nr_classes > UPCALL_BUF_CLASSES)
+		return -EINVAL;
+
+	memcpy(sorted, classes, nr_classes * sizeof(*classes));
+	for (int i = 1; i < nr_classes; i++) {
+		tmp = sorted[i];
+		for (nr = i; nr > 0 && sorted[nr - 1].size > tmp.size; nr--)
+			sorted[nr] = sorted[nr - 1];
+		sorted[nr] = tmp;
+	}
+
+	for (int i = 0; i < nr_classes; i++) {
+		/* Pool buffers also carry the 8 byte upcall_post() wakeups */
+		if (sorted[i].size < sizeof(uint64_t) || !sorted[i].count)
+			return -EINVAL;
+		if (i && sorted[i].size == sorted[i - 1].size)
+			return -EINVAL;
+	}
+
+	ret = backend_setup();
+	if (ret)
+		return ret;
+	if (nr_classes > 1 && !backend->classes)
+		return -EOPNOTSUPP;
+
+	ctx = calloc(1, sizeof(struct upcall_ctx));
+	if (!ctx)
+		return -ENOMEM;
+	memcpy(ctx->classes, sorted, nr_classes * sizeof(*classes));
+	ctx->nr_classes = nr_classes;
+	pthread_mutex_init(&ctx->init_lock, NULL);
+	pthread_cond_init(&ctx->init_cond, NULL);
+	pthread_cond_init(&ctx->go_cond, NULL);
+
+	nr = place_workers(ctx, cpus);
+	if (nr < 0) {
+		ret = nr;
+		goto out_ctx;
+	}
+
+	ctx->upfd = upcall_create(0);
+	if (ctx->upfd < 0) {
+		ret = -errno;
+		goto out_ctx;
+	}
+
+	ctx->workers = aligned_alloc(64, nr * sizeof(struct upcall_worker));
+	if (!ctx->workers) {
+		ret = -ENOMEM;
+		goto out_upfd;
+	}
+	for (inited = 0; inited < nr; inited++) {
+		ctx->workers[inited].id    = inited;
+		ctx->workers[inited].ctx   = ctx;
+		ctx->workers[inited].stats = NULL;
+		ctx->workers[inited].timed_out = false;
+		ctx->workers[inited].arena = NULL;
+		tasks_init(&ctx->workers[inited]);
+		ret = mailbox_init(&ctx->workers[inited]);
+		if (ret)
+			goto out_workers;
+#ifdef UPCALL_TRACE
+		ctx->workers[inited].trace = trace_alloc();
+#endif
+	}
+
+	spin_env = getenv("UPCALL_SPIN_US");
+	if (spin_env && *spin_env)
+		ctx->spin_us = strtoul(spin_env, NULL, 10);
+	ctx->spin_adaptive = true;
+
+	budget_env = getenv("UPCALL_DISPATCH_CYCLES");
+	if (budget_env && *budget_env)
+		ctx->dispatch_budget = strtoull(budget_env, NULL, 10);
+
+	ctx->nr_workers = nr;
+	ctx->setup_fn   = setup_fn;
+	ctx->loop_fn    = loop_fn;
+
+	ret = pthread_attr_init(&attr);
+	if (ret) {
+		ret = -ret;
+		goto out_workers;
+	}
+
+	for (started = 0; started < nr; started++) {
 		CPU_ZERO(&cpuset);
-		CPU_SET(i, &cpuset);
+		CPU_SET(ctx->worker_cpu[started], &cpuset);
 		ret = pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+		if (!ret)
+			ret = pthread_create(&ctx->workers[started].tid, &attr,
+					     upcall_worker_fn, &ctx->workers[started]);
 		if (ret) {
-			pthread_attr_destroy(&attr);
-			return -ret;
-		}
-		ret = pthread_create(&tid, &attr, upcall_worker_fn,
-				     (void *)(intptr_t)i);
-		if (ret) {
-			pthread_attr_destroy(&attr);
-			return -ret;
+			ret = -ret;
+			break;
 		}
 	}
 	pthread_attr_destroy(&attr);
+	if (started < nr)
+		goto out_threads;
 
 	/* Wait until every worker has completed setup_fn */
-	pthread_mutex_lock(&g_init_lock);
-	while (g_init_count < nr)
-		pthread_cond_wait(&g_init_cond, &g_init_lock);
-	pthread_mutex_unlock(&g_init_lock);
+	pthread_mutex_lock(&ctx->init_lock);
+	while (ctx->init_count < nr)
+		pthread_cond_wait(&ctx->init_cond, &ctx->init_lock);
+	pthread_mutex_unlock(&ctx->init_lock);
 
+	*ctxp = ctx;
 	return 0;
+
+	/*
+	 * Workers that did start see the pool stopped, with its deadline long
+	 * gone, as soon as their setup_fn is done, and clean up after
+	 * themselves.
+	 */
+out_threads:
+	ctx->deadline = 0;
+	__atomic_store_n(&ctx->stop, 1, __ATOMIC_RELEASE);
+	upcall_ctx_go(ctx);
+	for (int i = 0; i < started; i++)
+		pthread_join(ctx->workers[i].tid, NULL);
+out_workers:
+	for (int i = 0; i < inited; i++) {
+		close(ctx->workers[i].wake_fd);
+#ifdef UPCALL_TRACE
+		free(ctx->workers[i].trace);
+#endif
+	}
+	close(ctx->upfd);
+	workers_unmap(ctx, inited);
+	free(ctx->workers);
+	goto out_ctx;
+out_upfd:
+	close(ctx->upfd);
+out_ctx:
+	pthread_cond_destroy(&ctx->go_cond);
+	pthread_cond_destroy(&ctx->init_cond);
+	pthread_mutex_destroy(&ctx->init_lock);
+	free(ctx->worker_cpu);
+	free(ctx);
+	return ret;
+}
+
+int upcall_ctx_init(struct upcall_ctx **ctxp, const cpu_set_t *cpus,
+		    size_t bufs, size_t buf_sz,
+		    void (*setup_fn)(int worker_id, int nr_workers),
+		    void (*loop_fn)(void))
+{
+	struct upcall_buf_class cls = { .size = buf_sz, .count = bufs };
+
+	return upcall_ctx_init_classes(ctxp, cpus, &cls, 1, setup_fn, loop_fn);
+}
+
+void upcall_ctx_go(struct upcall_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->init_lock);
+	ctx->go = true;
+	pthread_cond_broadcast(&ctx->go_cond);
+	pthread_mutex_unlock(&ctx->init_lock);
+}
+
+void upcall_ctx_set_spin(struct upcall_ctx *ctx, uint32_t budget_us,
+			 bool adaptive)
+{
+	__atomic_store_n(&ctx->spin_adaptive, adaptive, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->spin_us, budget_us, __ATOMIC_RELAXED);
+}
+
+void upcall_set_spin(uint32_t budget_us, bool adaptive)
+{
+	struct upcall_ctx *ctx = current_ctx();
+
+	if (ctx)
+		upcall_ctx_set_spin(ctx, budget_us, adaptive);
+}
+
+void upcall_ctx_set_dispatch_budget(struct upcall_ctx *ctx, uint64_t cycles)
+{
+	__atomic_store_n(&ctx->dispatch_budget, cycles, __ATOMIC_RELAXED);
+}
+
+void upcall_set_dispatch_budget(uint64_t cycles)
+{
+	struct upcall_ctx *ctx = current_ctx();
+
+	if (ctx)
+		upcall_ctx_set_dispatch_budget(ctx, cycles);
+}
+
+int upcall_ctx_fini(struct upcall_ctx *ctx, uint64_t timeout_us,
+		    struct upcall_stats *final)
+{
+	uint64_t one = 1;
+	int ret = 0;
+
+	if (!ctx)
+		return -EINVAL;
+	if (tls_worker && tls_worker->ctx == ctx)
+		return -EDEADLK;
+
+	ctx->deadline = now_us() + timeout_us;
+	__atomic_store_n(&ctx->stop, 1, __ATOMIC_RELEASE);
+
+	/* Workers that never got the go still have to come out and clean up */
+	upcall_ctx_go(ctx);
+	for (int i = 0; i < ctx->nr_workers; i++) {
+		if (write(ctx->workers[i].wake_fd, &one, sizeof(one)) != sizeof(one))
+			perror("upcall_ctx_fini wakeup");
+	}
+
+	for (int i = 0; i < ctx->nr_workers; i++) {
+		pthread_join(ctx->workers[i].tid, NULL);
+		if (ctx->workers[i].timed_out)
+			ret = -ETIMEDOUT;
+		if (final)
+			final[i] = ctx->workers[i].final;
+		close(ctx->workers[i].wake_fd);
+#ifdef UPCALL_TRACE
+		free(ctx->workers[i].trace);
+#endif
+	}
+
+	/* Nothing can land in the arenas once the upfd is gone */
+	close(ctx->upfd);
+	workers_unmap(ctx, ctx->nr_workers);
+	pthread_cond_destroy(&ctx->go_cond);
+	pthread_cond_destroy(&ctx->init_cond);
+	pthread_mutex_destroy(&ctx->init_lock);
+	free(ctx->workers);
+	free(ctx->worker_cpu);
+	if (ctx == g_default_ctx)
+		g_default_ctx = NULL;
+	free(ctx);
+	return ret;
+}
+
+int upcall_fini(uint64_t timeout_us, struct upcall_stats *final)
+{
+	return upcall_ctx_fini(g_default_ctx, timeout_us, final);
+}
+
+int upcall_init(size_t bufs, size_t buf_sz,
+		void (*setup_fn)(int worker_id, int nr_workers),
+		void (*loop_fn)(void))
+{
+	return upcall_init_cpus(NULL, bufs, buf_sz, setup_fn, loop_fn);
+}
+
+int upcall_init_cpus(const cpu_set_t *cpus, size_t bufs, size_t buf_sz,
+		     void (*setup_fn)(int worker_id, int nr_workers),
+		     void (*loop_fn)(void))
+{
+	if (g_default_ctx)
+		return -EBUSY;
+	return upcall_ctx_init(&g_default_ctx, cpus, bufs, buf_sz,
+			       setup_fn, loop_fn);
+}
+
+int upcall_init_classes(const cpu_set_t *cpus,
+			const struct upcall_buf_class *classes, int nr_classes,
+			void (*setup_fn)(int worker_id, int nr_workers),
+			void (*loop_fn)(void))
+{
+	if (g_default_ctx)
+		return -EBUSY;
+	return upcall_ctx_init_classes(&g_default_ctx, cpus, classes,
+				       nr_classes, setup_fn, loop_fn);
 }
 
 void upcall_workers_go(void)
 {
-	pthread_mutex_lock(&g_init_lock);
-	g_go = true;
-	pthread_cond_broadcast(&g_go_cond);
-	pthread_mutex_unlock(&g_init_lock);
+	if (g_default_ctx)
+		upcall_ctx_go(g_default_ctx);
 }
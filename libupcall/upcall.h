@@ -20,17 +20,40 @@
 #ifndef UPCALL_H_
 #define UPCALL_H_
 
+#include <sched.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum {
-	UP_READ,	/* Requesting a read of the fd */
+	UP_READ,	/* Requesting a read of the fd, len is a buffer size hint */
 	UP_WRITE,	/* Requesting a write of the fd */
 	UP_ACCEPT,	/* Requesting an accept4 on the fd (will imply SOCK_NONBLOCK) */
-	UP_VEC,		/* Give the struct iovec array at buf with len items to the kernel */
+	UP_VEC,		/* Give the struct iovec array at buf with len items to the kernel,
+			 * fd is their size class, 0 as in the original ABI with one class */
+	UP_WRITEV,	/* Requesting a writev of the struct iovec array at buf with len items */
+	UP_TIMEOUT,	/* Completion only: an add_timer() timer expired, buf is its arg */
+	UP_CONNECT,	/* Requesting a connect of the fd to the struct sockaddr at buf, len bytes */
+	UP_CLOSE,	/* Requesting a close of the fd, cancelling what is queued on it */
+	UP_SHUTDOWN,	/* Requesting a shutdown of the fd, len is how */
+	UP_POLL,	/* Requesting readiness of the fd for the POLL* events in len */
+	UP_PREAD,	/* Requesting a pread of the fd, buf is a struct up_file_io */
+	UP_PWRITE,	/* Requesting a pwrite of the fd, buf is a struct up_file_io */
+	UP_SENDFILE,	/* Requesting a sendfile to the fd, buf is a struct up_file_io */
+	UP_CANCEL,	/* Requesting cancellation of what is outstanding on the fd, see UP_F_MATCH */
 	NR_ACTIONS
 } up_action_t;
 
+/*
+ * libupcall's event.  The syscalls still take the original 40 byte event,
+ * without flags or user_data; the kernel backend keeps those on the side
+ * for each action it submits.
+ */
 struct up_event {
 	int32_t		fd;
 	int32_t		result;
@@ -38,36 +61,122 @@ struct up_event {
 	uint64_t	len;
 	void		(*work_fn)(struct up_event *arg);
 	union {
-		up_action_t	type;
+		struct {
+			up_action_t	type;
+			uint32_t	flags;	/* UP_F_* */
+		};
 		uint64_t	pad;
 	};
+	uint64_t	user_data;	/* the caller's cookie, returned untouched */
 } __attribute__((packed));
 
+#define UP_F_MULTISHOT	(1U << 0)	/* UP_READ/UP_ACCEPT/UP_POLL keep completing until UP_F_LAST */
+#define UP_F_LAST	(1U << 1)	/* Set on the completion that ends a registration */
+#define UP_F_MATCH	(1U << 2)	/* UP_CANCEL only hits actions with its user_data */
+
 #define UPCALL_MASK             (O_CLOEXEC)
 
+/* upcall_submit flags: return 0 rather than wait when nothing completed */
+#define UPCALL_SUBMIT_NOWAIT	(1U << 0)
+
 typedef unsigned __poll_t;
 
+struct upcall_stats;
+
 /*
- * Returns the number of online CPUs — equal to the number of worker threads
- * that upcall_init() will spawn.
+ * Returns the number of worker threads in the calling worker's pool, or
+ * in the upcall_init() pool when called from elsewhere.  Before
+ * upcall_init(), returns the number it would spawn (one per CPU in the
+ * process's affinity mask).
  */
 int upcall_nr_workers(void);
 
 /*
- * Spawn one worker thread per online CPU, each pinned to its CPU.
- * Internally calls upcall_worker_setup(bufs, buf_sz) per worker, then
+ * Spawn one worker thread per CPU the process may run on (its
+ * sched_getaffinity() mask, so CPUs that are offline or outside our
+ * cpuset get no worker), each pinned to its CPU.  Worker ids go to the
+ * first SMT thread of every core, ordered by package and core, before any
+ * sibling thread; use upcall_worker_cpu()/upcall_cpu_worker() to map
+ * between the two.
+ *
+ * Internally sets up a pool of bufs buffers of buf_sz per worker, then
  * invokes setup_fn (if non-NULL) so each worker can register its initial
  * events (add_accept, add_read, etc.).  Blocks until every worker has
  * completed setup_fn.  Workers then wait for upcall_workers_go().
  *
  * loop_fn (may be NULL) is called from each worker between event batches.
+ * buf_sz must be at least 8 bytes.
  *
- * Returns 0 on success, -errno on failure.
+ * This creates the process's default pool; see upcall_ctx_init() for
+ * running more than one.  Returns 0 on success, -EBUSY if the default
+ * pool already exists, -errno on other failures.
  */
 int upcall_init(size_t bufs, size_t buf_sz,
 		void (*setup_fn)(int worker_id, int nr_workers),
 		void (*loop_fn)(void));
 
+/*
+ * Receive buffer size classes.  A pool can hold up to UPCALL_BUF_CLASSES
+ * sizes of buffer, count of each per worker, so small messages do not tie
+ * up large buffers; each read picks a class with add_read_hint().  The
+ * upcall_init() variants set up a single class.
+ */
+#define UPCALL_BUF_CLASSES 4
+
+struct upcall_buf_class {
+	size_t	size;		/* at least 8 bytes, distinct per pool */
+	size_t	count;		/* buffers per worker, at least 1 */
+};
+
+/*
+ * upcall_init() restricted to the CPUs in cpus (NULL for all of them).
+ * CPUs outside the affinity mask are dropped; -EINVAL if none are left.
+ */
+int upcall_init_cpus(const cpu_set_t *cpus, size_t bufs, size_t buf_sz,
+		     void (*setup_fn)(int worker_id, int nr_workers),
+		     void (*loop_fn)(void));
+
+/*
+ * upcall_init_cpus() with nr_classes buffer size classes, in any order.
+ * -EINVAL if nr_classes is not 1..UPCALL_BUF_CLASSES or a class is too
+ * small, empty or repeats a size, -EOPNOTSUPP for more than one class on
+ * a backend with a single pool (the kernel backend).
+ */
+int upcall_init_classes(const cpu_set_t *cpus,
+			const struct upcall_buf_class *classes, int nr_classes,
+			void (*setup_fn)(int worker_id, int nr_workers),
+			void (*loop_fn)(void));
+
+/*
+ * CPU that worker worker_id is pinned to, or -1 for a bad id.
+ */
+int upcall_worker_cpu(int worker_id);
+
+/*
+ * Worker pinned to cpu (e.g. from SO_INCOMING_CPU), or -1 if that CPU
+ * has no worker.
+ */
+int upcall_cpu_worker(int cpu);
+
+/*
+ * Name of the backend carrying upcall_create/upcall_submit: "kernel" for
+ * the upcall syscalls or "epoll" for the user-space emulation.  The
+ * default is chosen at configure time (--with-upcall-backend) and can be
+ * overridden with the UPCALL_BACKEND environment variable.  The backend
+ * is settled once per process, by the first pool or the first call to
+ * this: later changes to UPCALL_BACKEND have no effect.
+ */
+const char *upcall_backend_name(void);
+
+/*
+ * Can actions of this type be carried out on the backend?  False for the
+ * ones that would only ever complete with -EOPNOTSUPP, e.g. UP_CONNECT on
+ * the kernel backend.  Actions libupcall makes up for itself (UP_WRITEV,
+ * UP_CLOSE, UP_SHUTDOWN, UP_CANCEL) and timers are always available.
+ * Settles the backend like upcall_backend_name().
+ */
+bool upcall_backend_has(up_action_t type);
+
 /*
  * Release all workers into the event loop.  Must be called after
  * upcall_init() returns.  The window between upcall_init() and
@@ -77,27 +186,169 @@ int upcall_init(size_t bufs, size_t buf_sz,
 void upcall_workers_go(void);
 
 /*
- * Returns the 0-indexed worker ID of the calling thread.
+ * Busy polling for the calling worker's pool (or the upcall_init() pool).
+ * With a budget, a worker that finds nothing ready keeps polling the
+ * backend without blocking for up to budget_us before it goes to sleep
+ * in upcall_submit, trading CPU time for wakeup latency.  0 (the default,
+ * unless $UPCALL_SPIN_US is set at init) always sleeps at once.
+ *
+ * With adaptive set (the default), a worker stops spinning while events
+ * have recently taken longer than the budget to arrive, and resumes when
+ * they speed up again.  The spins/spin_hits/sleeps/spin_cycles counters
+ * in struct upcall_stats show how the split works out.  May be changed at
+ * any time from any thread.
+ */
+void upcall_set_spin(uint32_t budget_us, bool adaptive);
+
+/*
+ * Dispatch budget for the calling worker's pool (or the upcall_init()
+ * pool), in the TSC ticks upcall_stats() counts cycles in.  Once a
+ * worker's callbacks for one batch of completions have run for that long,
+ * the rest are deferred: the actions queued so far are submitted right
+ * away and the deferred completions are delivered, in order and ahead of
+ * anything newer, after that submit, which does not wait.  One slow
+ * callback then only delays its own batch so much.  At least one
+ * completion is delivered per round, and no more than one submit's worth
+ * are ever held back.  0 (the default, unless $UPCALL_DISPATCH_CYCLES is
+ * set at init) delivers every batch in full.  The deferrals/deferred
+ * counters in struct upcall_stats show how often it cuts in.  Has no
+ * effect on backends that cannot submit without waiting.  May be changed
+ * at any time from any thread.
+ */
+void upcall_set_dispatch_budget(uint64_t cycles);
+
+/*
+ * Shut down the upcall_init() pool; see upcall_ctx_fini().  upcall_init()
+ * may be called again afterwards.
+ */
+int upcall_fini(uint64_t timeout_us, struct upcall_stats *final);
+
+/*
+ * Returns the 0-indexed worker ID of the calling thread within its pool.
  * Returns -1 if called from outside a libupcall worker thread.
  */
 int upcall_worker_id(void);
 
+/* --- Independent worker pools ---
+ * A process can run several pools side by side, each with its own upfd,
+ * buffer pool size and CPU set, e.g. a latency-critical pool with small
+ * buffers on isolated cores next to a bulk pool with 64KB buffers.  The
+ * context-free calls in this header act on the calling worker's own pool,
+ * or on the upcall_init() pool when called from any other thread, so
+ * callbacks never need the context.  Pools should not share CPUs.
+ */
+struct upcall_ctx;
+
+/*
+ * Same as upcall_init_cpus(), but creates a new pool and stores its handle
+ * in *ctxp.  Returns 0 on success, -errno on failure.
+ */
+int upcall_ctx_init(struct upcall_ctx **ctxp, const cpu_set_t *cpus,
+		    size_t bufs, size_t buf_sz,
+		    void (*setup_fn)(int worker_id, int nr_workers),
+		    void (*loop_fn)(void));
+
+/* upcall_init_classes() for a new pool */
+int upcall_ctx_init_classes(struct upcall_ctx **ctxp, const cpu_set_t *cpus,
+			    const struct upcall_buf_class *classes,
+			    int nr_classes,
+			    void (*setup_fn)(int worker_id, int nr_workers),
+			    void (*loop_fn)(void));
+
+/* upcall_workers_go() for ctx */
+void upcall_ctx_go(struct upcall_ctx *ctx);
+
+/* upcall_set_spin() for ctx */
+void upcall_ctx_set_spin(struct upcall_ctx *ctx, uint32_t budget_us,
+			 bool adaptive);
+
+/* upcall_set_dispatch_budget() for ctx */
+void upcall_ctx_set_dispatch_budget(struct upcall_ctx *ctx, uint64_t cycles);
+
+/*
+ * Stop a pool and free it.  Every worker stops taking connections (accept
+ * completions are closed, accept registrations are not renewed) and keeps
+ * running, callbacks and all, until it has no writes (pwrites and
+ * sendfiles included) queued or in flight
+ * and no upcall_post() messages left, or until timeout_us has passed.
+ * Workers then free their queues and backend state and are joined;
+ * pending timers are dropped.  The buffer arenas are unmapped last, once
+ * the pool's upfd is closed and reads still outstanding can no longer
+ * land in them.  Must not be called from one of the
+ * pool's own workers.  Closing the application's own fds, including
+ * listening sockets, is left to the caller.
+ *
+ * If final is not NULL it receives each worker's closing counters, one
+ * struct upcall_stats per worker.  ctx is invalid once this returns.
+ *
+ * Returns 0 if every worker drained, -ETIMEDOUT if the deadline cut one
+ * short (the pool is torn down either way), -EINVAL or -EDEADLK.
+ */
+int upcall_ctx_fini(struct upcall_ctx *ctx, uint64_t timeout_us,
+		    struct upcall_stats *final);
+
+/* The calling worker's pool, or NULL outside a worker thread */
+struct upcall_ctx *upcall_ctx_self(void);
+
+/* Per-pool versions of the calls of the same name without ctx_ */
+int upcall_ctx_nr_workers(struct upcall_ctx *ctx);
+int upcall_ctx_worker_cpu(struct upcall_ctx *ctx, int worker_id);
+int upcall_ctx_cpu_worker(struct upcall_ctx *ctx, int cpu);
+
 /* --- Callback-facing API ---
  * Safe to call from setup_fn, loop_fn, and event callbacks.
  * Calls queue work into the calling worker's submission batch; the batch
  * is submitted to the kernel on the next run_event_loop round-trip.
+ *
+ * The kernel backend only carries the original reads, writes and
+ * accepts.  An action a pool's backend has no way to carry out (connect,
+ * poll, pread, pwrite and sendfile on the kernel backend) is never
+ * submitted: its work_fn runs on the next round with -EOPNOTSUPP.
  */
 /*
  * Return a buffer to the per-worker pool so it can be recycled.  Safe to
- * call with a buffer allocated by the caller (e.g. when the pool ran dry
- * and a new buffer was malloc'd to replenish it).
+ * call with a buffer allocated by the caller, which then joins the pool.
+ *
+ * There is no need to replace buffers that callbacks are still holding.
+ * Each class also keeps a reserve in the arena, as many buffers again as
+ * its count by default.  Before every submit, a class whose backend share
+ * has fallen below 75% of count is topped back up to count from it, and
+ * one that returns would take over 125% puts the surplus back.  Reads
+ * only see -ENOMEM once the reserve is spent as well, which upcall_stats()
+ * reports as pool_stalls.  Build with UPCALL_POOL_RESERVE, UPCALL_POOL_LOW
+ * and UPCALL_POOL_HIGH (percent of count) defined to change these.
+ *
+ * Pool buffers live in one prefaulted arena per worker (2MB pages for
+ * pools of 1MB or more), cache line aligned (page aligned for classes of
+ * 4KB and up), and go back to their own class.  A caller's buffer joins
+ * the largest class it can hold.  Passing a pointer
+ * that lies inside the arena but is not the start of a pool buffer aborts.
  */
 void return_buffer(void *buf, size_t len);
 
 /*
- * Size of each buffer in the per-worker pool (the buf_sz passed to
- * upcall_init).  Use this when allocating a replacement buffer after
- * receiving -ENOMEM from a read event.
+ * Take ownership of the pool buffer delivered with a read completion, so
+ * the payload can be kept or handed straight to add_write() without a
+ * copy.  The pool is topped up from a per-worker list of spare buffers
+ * (one per pool buffer) on the next submit, so retaining never shrinks
+ * what the kernel has to read into.  evt->buf is cleared.
+ *
+ * Returns the buffer, or NULL if evt carries no buffer or every spare is
+ * in use; the caller then copies the data and calls return_buffer() as
+ * before.
+ */
+void *upcall_buf_retain(struct up_event *evt);
+
+/*
+ * Give back a buffer obtained from upcall_buf_retain() once the caller
+ * (e.g. the write it was passed to) is done with it.  Must be called on
+ * the worker that retained it.
+ */
+void upcall_buf_release(void *buf);
+
+/*
+ * Size of the largest buffers in the per-worker pool (the buf_sz passed
+ * to upcall_init, or to upcall_ctx_init for the calling worker's pool).
  */
 size_t upcall_buf_sz(void);
 
@@ -106,4 +357,361 @@ void add_accept(int fd, void (*work_fn)(struct up_event *evt));
 void add_write(int fd, void *buf, size_t len,
 	       void (*work_fn)(struct up_event *evt));
 
+/*
+ * Persistent versions of add_read/add_accept: the registration keeps
+ * delivering completions to work_fn, without being re-added, until one
+ * arrives with UP_F_LAST set in evt->flags (end of file or an error other
+ * than -ENOMEM).  Do not close the fd while the registration is live.
+ */
+void add_read_multishot(int fd, void (*work_fn)(struct up_event *evt));
+void add_accept_multishot(int fd, void (*work_fn)(struct up_event *evt));
+
+/*
+ * add_read/add_read_multishot expecting about size_hint bytes: the read
+ * gets a buffer from the smallest class that holds size_hint, or from the
+ * largest class if none does, falling back to whatever class still has
+ * buffers.  add_read() passes 0, which also means the largest class.
+ * Re-armed reads keep the class of the buffer they last completed with.
+ */
+void add_read_hint(int fd, size_t size_hint,
+		   void (*work_fn)(struct up_event *evt));
+void add_read_multishot_hint(int fd, size_t size_hint,
+			     void (*work_fn)(struct up_event *evt));
+
+/*
+ * The same actions tagged with user_data, which comes back unchanged in
+ * evt->user_data of every completion they produce (re-armed multishot
+ * ones and finished writevs included), so work_fn can go straight to the
+ * connection it belongs to instead of looking evt->fd up.  The untagged
+ * versions pass 0.  add_connect_data() and add_poll_data() below are the
+ * same for connects and polls.
+ */
+void add_read_data(int fd, void (*work_fn)(struct up_event *evt),
+		   uint64_t user_data);
+void add_read_multishot_data(int fd, void (*work_fn)(struct up_event *evt),
+			     uint64_t user_data);
+void add_accept_data(int fd, void (*work_fn)(struct up_event *evt),
+		     uint64_t user_data);
+void add_accept_multishot_data(int fd, void (*work_fn)(struct up_event *evt),
+			       uint64_t user_data);
+void add_write_data(int fd, void *buf, size_t len,
+		    void (*work_fn)(struct up_event *evt), uint64_t user_data);
+
+/*
+ * Connect the non-blocking socket fd to addr.  work_fn runs once, when the
+ * connection is established (evt->result 0) or has failed (-errno); evt->buf
+ * is addr and evt->len addrlen.  addr must stay valid until then.
+ */
+void add_connect(int fd, const struct sockaddr *addr, socklen_t addrlen,
+		 void (*work_fn)(struct up_event *evt));
+void add_connect_data(int fd, const struct sockaddr *addr, socklen_t addrlen,
+		      void (*work_fn)(struct up_event *evt),
+		      uint64_t user_data);
+
+/*
+ * Wait for any pollable fd (eventfd, timerfd, pipe, signalfd, ...) to
+ * become ready for one of events (POLLIN, POLLOUT, POLLPRI, POLLRDHUP).
+ * evt->result is the ready events, POLLERR and POLLHUP included, or
+ * -errno; nothing is read or written.  The multishot version completes
+ * each submit the fd is still ready after, so work_fn should drain the fd,
+ * and ends, with UP_F_LAST, only on an error.  Several polls may wait on
+ * one fd, alongside its reads and writes.
+ */
+void add_poll(int fd, uint32_t events, void (*work_fn)(struct up_event *evt));
+void add_poll_multishot(int fd, uint32_t events,
+			void (*work_fn)(struct up_event *evt));
+void add_poll_data(int fd, uint32_t events,
+		   void (*work_fn)(struct up_event *evt), uint64_t user_data);
+
+/*
+ * Cancel every action still outstanding on fd, e.g. on a connection that
+ * is going away.  Each completes exactly once more, with -ECANCELED (and
+ * UP_F_LAST): a multishot registration ends with a single such completion
+ * and reads, accepts and polls that have already been reaped but not yet
+ * delivered, in this batch or held by the backend, are turned into it or
+ * dropped, never delivered with data.  Their pool buffers go straight
+ * back to the pool, and sockets they accepted are closed.  Writes that
+ * already completed are still reported as such.  work_fn (may be NULL)
+ * gets 0.  The kernel backend cannot take back what it has submitted, so
+ * there libupcall cancels what is still queued itself, and a read or
+ * accept already submitted gets its -ECANCELED only once the kernel
+ * completes it; a write already submitted reports what the kernel did.
+ */
+void add_cancel(int fd, void (*work_fn)(struct up_event *evt));
+
+/*
+ * add_cancel() of only those actions on fd tagged with user_data, e.g.
+ * one request of several sharing a connection.  UP_F_MATCH is set on the
+ * UP_CANCEL, and its own completion carries user_data too.
+ */
+void add_cancel_data(int fd, void (*work_fn)(struct up_event *evt),
+		     uint64_t user_data);
+
+/*
+ * Close fd as part of the next submit rather than inside the callback.
+ * Everything outstanding on fd is cancelled first, as by add_cancel().
+ * work_fn (may be NULL) then gets close()'s 0 or -errno.  Queue nothing
+ * more on fd once this is called, and expect its number to be reused by
+ * the time the completions run.  The kernel backend has no UP_CLOSE: there
+ * libupcall cancels what is queued on fd and closes it inside this call,
+ * and work_fn still runs from the event loop.
+ */
+void add_close(int fd, void (*work_fn)(struct up_event *evt));
+
+/*
+ * shutdown(fd, how) as part of the next submit, after any writes already
+ * queued on fd.  Pending reads see end-of-file as they would after a
+ * direct shutdown().  work_fn (may be NULL) gets 0 or -errno.  The kernel
+ * backend has no UP_SHUTDOWN: there libupcall calls shutdown() inside
+ * this call, ahead of writes not yet complete, so shut down from the last
+ * write's callback when they must go out first.
+ */
+void add_shutdown(int fd, int how, void (*work_fn)(struct up_event *evt));
+
+/*
+ * Write the iovcnt buffers described by iov to fd as a single action.
+ * Short writes are continued inside libupcall from the right iovec and
+ * offset, so work_fn runs exactly once: with evt->result the total number
+ * of bytes written, or the 0 / -errno that stopped the write part way.
+ * evt->type is UP_WRITEV, evt->buf is iov and evt->len is iovcnt.
+ *
+ * The iovec array is copied, the data it points to must stay valid until
+ * work_fn runs.  Only one add_writev() per fd may be outstanding.
+ *
+ * Returns 0, -EINVAL for a bad iovcnt or -EBUSY if fd already has one.
+ */
+int add_writev(int fd, const struct iovec *iov, int iovcnt,
+	       void (*work_fn)(struct up_event *evt));
+int add_writev_data(int fd, const struct iovec *iov, int iovcnt,
+		    void (*work_fn)(struct up_event *evt), uint64_t user_data);
+
+/*
+ * Positional file I/O, so storage-backed responses go through the same
+ * completion path as socket I/O.  This does not make them asynchronous:
+ * the epoll backend carries out a pread or pwrite on the spot, from the
+ * submit, and sendfile reads the file as it goes, so a cold page cache
+ * blocks the worker for the disk read.  The kernel backend does not carry
+ * them at all (work_fn gets -EOPNOTSUPP).  The caller owns the struct
+ * up_file_io and keeps it alive until work_fn runs with evt->buf pointing
+ * at it and evt->result the number of bytes moved or -errno.  A single
+ * action moves at most INT32_MAX bytes.
+ *
+ * add_pread()/add_pwrite() move up to len bytes between buf and fd at
+ * offset off, with the same short counts as pread(2)/pwrite(2).
+ *
+ * add_sendfile() sends len bytes of file_fd, from off, to the socket fd
+ * without copying them through user space (buf is unused).  Short sends
+ * are continued internally, so the result is len unless the file ended or
+ * an error stopped it; off and len are advanced as the data goes out.
+ * Shares the socket's write ordering with add_write()/add_writev().
+ */
+struct up_file_io {
+	void		*buf;
+	uint64_t	len;
+	int64_t		off;
+	int32_t		file_fd;
+};
+
+void add_pread(int fd, struct up_file_io *io,
+	       void (*work_fn)(struct up_event *evt));
+void add_pwrite(int fd, struct up_file_io *io,
+		void (*work_fn)(struct up_event *evt));
+void add_sendfile(int fd, struct up_file_io *io,
+		  void (*work_fn)(struct up_event *evt));
+
+/*
+ * Per-worker timers.  The caller owns the struct upcall_timer (typically
+ * embedded in its connection state) and must keep it alive while the
+ * timer is pending; zero it before first use.  Timers are kept in a timer
+ * wheel with a 100us tick and fire on the worker that added them, never
+ * early and normally within a tick of the deadline, even while the worker
+ * is otherwise idle in upcall_submit.
+ */
+struct upcall_timer {
+	struct upcall_timer	*next;
+	struct upcall_timer	**pprev;	/* NULL when not pending */
+	uint64_t		expires;
+	void			(*work_fn)(struct up_event *evt);
+	void			*arg;
+};
+
+/*
+ * Call work_fn once, usecs microseconds from now, with an event whose type
+ * is UP_TIMEOUT, fd is -1 and buf is arg.  Adding a pending timer moves
+ * it.  work_fn may add the timer again to make it periodic.
+ */
+void add_timer(struct upcall_timer *t, uint64_t usecs,
+	       void (*work_fn)(struct up_event *evt), void *arg);
+
+/*
+ * Stop a pending timer.  Returns 1 if it was pending, 0 if it had already
+ * fired or was never added.
+ */
+int cancel_timer(struct upcall_timer *t);
+
+/* --- Cross-worker messages ---
+ * Safe to call from any thread, including non-worker threads.
+ */
+/*
+ * Run fn(arg) on worker worker_id.  Messages land in a bounded lock-free
+ * ring owned by the target and are run from its event loop just before it
+ * next calls upcall_submit, in the order they were posted.  A sleeping
+ * worker is woken at most once per batch of posts.  fn may use the
+ * callback-facing API above on behalf of the target worker.
+ *
+ * Returns 0 on success, -EINVAL for a bad worker_id (or before
+ * upcall_init), -EAGAIN if the target's ring is full.
+ */
+int upcall_post(int worker_id, void (*fn)(void *arg), void *arg);
+int upcall_ctx_post(struct upcall_ctx *ctx, int worker_id,
+		    void (*fn)(void *arg), void *arg);
+
+/* --- Compute tasks ---
+ * Opt-in offload for CPU-heavy work, so one busy connection does not hold
+ * a whole worker while the rest of the pool idles.
+ */
+/*
+ * Queue fn(arg) on the calling worker.  The worker gets to its tasks
+ * after each batch of callbacks, a slice at a time, and any worker of the
+ * same pool with nothing else to do may steal them first, so fn can run
+ * on any worker and in any order: it must not use the callback-facing
+ * API.  done(arg) (may be NULL) then runs on the worker that spawned the
+ * task, from its event loop, and is where the results are put to use,
+ * e.g. with add_write(), so all I/O stays on the connection's worker.
+ *
+ * A worker whose deque is full runs the task before returning.
+ * upcall_ctx_fini() waits for outstanding tasks like it does for writes.
+ *
+ * Stealing is cheapest on a backend that can submit without waiting (the
+ * epoll backend, or a kernel that honours UPCALL_SUBMIT_NOWAIT).  On one
+ * that cannot, a worker steals at most one task every other round, and a
+ * worker asleep in the backend is only woken by the next upcall_spawn():
+ * tasks queued before it went to sleep wait for their owner or for its
+ * next completion.
+ *
+ * Must be called from a worker thread.  Returns 0, or -EINVAL outside a
+ * worker or without fn.
+ */
+int upcall_spawn(void (*fn)(void *arg), void (*done)(void *arg), void *arg);
+
+/* --- Batch dispatch --- */
+/*
+ * By default every completion is delivered by its own work_fn call, so a
+ * batch mixing reads, writes and accepts jumps between handlers.  Once
+ * work_fn has a batch_fn registered on the calling worker, all of its
+ * completions from one submit are instead passed to batch_fn as an array,
+ * in the order they were reaped, in place of the first of them.  The
+ * handler can then run through them in a tight loop and prefetch the
+ * next entry's state (e.g. from its user_data) while on the current one.
+ *
+ * Each entry is exactly what work_fn would have been given (UP_F_LAST,
+ * pool buffers and all), and the array is only valid during the call.
+ * Multishot registrations are re-armed after batch_fn returns, and
+ * completions for other handlers are delivered after it, so only register
+ * handlers that do not depend on the order of completions across them.
+ * Cancelling or closing an fd from batch_fn scrubs what other handlers
+ * are still to get, but not later entries of the array itself.
+ *
+ * So far this has shown no measured benefit: on the epoll emulation over
+ * loopback batches averaged one or two reads, and cycles per completion
+ * were no better than with per-completion dispatch.  Larger batches on
+ * the kernel backend are where it may pay off; event-tester's
+ * bench-batch.sh runs tcp_echo both ways and prints the counters.
+ *
+ * Must be called from a worker thread, typically from setup_fn.  A NULL
+ * batch_fn goes back to per-completion dispatch for work_fn.  At most
+ * UPCALL_BATCH_HANDLERS may be registered per worker.  Returns 0, -EINVAL
+ * outside a worker or without work_fn, or -ENOSPC once the table is full.
+ */
+#define UPCALL_BATCH_HANDLERS 8
+
+int upcall_batch_handler(void (*work_fn)(struct up_event *evt),
+			 void (*batch_fn)(struct up_event *evts, int cnt));
+
+/* --- Statistics --- */
+/*
+ * Completions per upcall_submit are bucketed by powers of two: bucket 0
+ * counts empty batches, bucket i (1..6) batches of 2^(i-1) to 2^i - 1
+ * completions and the last bucket everything from 64 up.
+ */
+#define UPCALL_STATS_BATCH_BUCKETS 8
+
+struct upcall_stats {
+	uint64_t	submits;		/* upcall_submit calls */
+	uint64_t	completions;		/* events delivered to work_fn */
+	uint64_t	batch_hist[UPCALL_STATS_BATCH_BUCKETS];
+	uint64_t	work_hwm;		/* most actions queued for one submit */
+	uint64_t	work_reallocs;		/* times the submission queue grew */
+	uint64_t	pool_depth;		/* buffers the backend holds for reads */
+	uint64_t	pool_underflows;	/* reads that completed with -ENOMEM */
+	uint64_t	pool_refills;		/* buffers added from the reserve */
+	uint64_t	pool_trims;		/* buffers put back in the reserve */
+	uint64_t	pool_stalls;		/* times the reserve ran dry below low */
+	uint64_t	callback_cycles;	/* in callbacks, posts and timers */
+	uint64_t	submit_cycles;		/* inside upcall_submit, spin included */
+	uint64_t	spins;			/* reaps that busy polled first */
+	uint64_t	spin_hits;		/* ... and found completions doing so */
+	uint64_t	sleeps;			/* reaps that waited in upcall_submit */
+	uint64_t	spin_cycles;		/* busy polling, part of submit_cycles */
+	uint64_t	tasks_spawned;		/* upcall_spawn() calls on this worker */
+	uint64_t	tasks_stolen;		/* other workers' tasks run here */
+	uint64_t	task_cycles;		/* in task fns, stolen ones included */
+	uint64_t	batches;		/* batch_fn calls, see upcall_batch_handler */
+	uint64_t	batched;		/* completions delivered through them */
+	uint64_t	deferrals;		/* batches the dispatch budget cut short */
+	uint64_t	deferred;		/* completions put off by it */
+};
+
+/*
+ * Copy a snapshot of worker worker_id's counters into *out.  Each worker
+ * only ever writes its own counters, so keeping them costs a few
+ * increments and four TSC reads per event loop round-trip (plus two
+ * clock reads when busy polling is on).  Safe to call
+ * from any thread; individual counters are read atomically, the snapshot
+ * as a whole is not.  Cycle counts are TSC ticks (nanoseconds on
+ * machines without a TSC).
+ *
+ * Returns 0, or -EINVAL for a bad worker_id (or before upcall_init).
+ */
+int upcall_stats(int worker_id, struct upcall_stats *out);
+int upcall_ctx_stats(struct upcall_ctx *ctx, int worker_id,
+		     struct upcall_stats *out);
+
+/* --- Tracing --- */
+/*
+ * When libupcall is configured with --enable-upcall-trace (UPCALL_TRACE),
+ * each worker logs a TSC timestamp, taken with rdtscp as in
+ * event-tester/tsc_logger.h, at every phase of its event loop, so a
+ * request's latency can be split into time waiting in the backend,
+ * libupcall's own dispatch and application callbacks.  A, B and C are
+ * the values logged with each phase.
+ */
+enum upcall_trace_phase {
+	UPCALL_TRACE_SUBMIT,		/* entering upcall_submit, A = actions queued */
+	UPCALL_TRACE_SUBMIT_DONE,	/* back from it, A = completions */
+	UPCALL_TRACE_CALLBACK,		/* work_fn called, A = fd, B = type, C = result;
+					 * for a batch_fn A = -1 and C = completions */
+	UPCALL_TRACE_CALLBACK_DONE,	/* work_fn returned, A = fd, B = type */
+	UPCALL_TRACE_LOOP_FN,		/* loop_fn called */
+	UPCALL_TRACE_LOOP_FN_DONE,	/* loop_fn returned */
+};
+
+/*
+ * Write every worker's trace so far to fd as tab separated text, one
+ * line per entry: worker id, CPU, TSC, phase name, A, B, C.  A worker
+ * whose log filled up gets a '#' comment line after its entries.  Safe
+ * to call from any thread while the pool runs, but entries being written
+ * at that moment may come out half done; call it before upcall_fini() for
+ * a complete trace.
+ *
+ * Returns 0, -EINVAL for a bad fd (or before upcall_init), -ENOTSUP if
+ * tracing is compiled out, or -errno from writing.
+ */
+int upcall_trace_dump(int fd);
+int upcall_ctx_trace_dump(struct upcall_ctx *ctx, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
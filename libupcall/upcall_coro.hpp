@@ -0,0 +1,607 @@
+/**
+ * Upcall support library - C++20 coroutine front end
+ * Copyright (C) 2024 Eric B Munson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Header-only, so there is nothing extra to link: a handler is an
+ * upcall::task coroutine that awaits libupcall actions in place of
+ * chaining callbacks.
+ *
+ *	upcall::task echo(int fd)
+ *	{
+ *		upcall::io up;
+ *
+ *		for (;;) {
+ *			struct up_event evt = co_await up.read(fd);
+ *			...
+ *			evt = co_await up.write(fd, buf, len);
+ *		}
+ *	}
+ *
+ * Each awaiter queues the matching add_*() call with a work_fn that
+ * resumes the coroutine, and co_await yields the completion as the C
+ * callback would have seen it (a read's pool buffer still belongs to the
+ * caller, as with add_read()).  Each awaiter takes a slot in a per-worker
+ * table and tags its action with the slot's cookie, which its completion
+ * brings back in user_data, so any number of them may wait on one fd.  A
+ * completion whose cookie is no longer live wakes nobody: its buffer goes
+ * back to the pool and a socket it accepted is closed.  An upcall::reader
+ * keeps a multishot read registered across a whole read loop instead.
+ *
+ * Tasks start running as soon as they are called, must be started on a
+ * libupcall worker (setup_fn, a callback, an upcall_post() message) and
+ * stay on that worker.  Their frames come from a per-worker free list, so
+ * starting one only calls malloc while the worker's frame slabs grow.
+ */
+
+#ifndef UPCALL_CORO_HPP_
+#define UPCALL_CORO_HPP_
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+
+#include <unistd.h>
+
+#include "upcall.h"
+
+namespace upcall {
+
+namespace detail {
+
+/* Frames are rounded up to a 64 byte class; bigger ones go to malloc */
+constexpr size_t FRAME_GRAIN	= 64;
+constexpr size_t FRAME_CLASSES	= 32;
+constexpr size_t FRAME_SLAB	= 64 * 1024;
+
+struct frame {
+	frame *next;
+};
+
+class io_await;
+
+/*
+ * An awaiter waiting on its completion.  The cookie of a slot is its
+ * index in the low 32 bits and its generation in the high ones, which
+ * moves on whenever the slot is given back.
+ */
+struct await_slot {
+	io_await	*await;
+	uint32_t	gen;
+	uint32_t	next;		/* free list, index + 1 */
+};
+
+/*
+ * Everything here is only touched by its own worker.  Kept trivially
+ * destructible so the hot paths need no TLS guard; worker_reaper frees it
+ * when the worker thread exits.
+ */
+struct worker_state {
+	frame		*free[FRAME_CLASSES];
+	frame		*slabs;
+	await_slot	*slots;
+	uint32_t	nr_slots;
+	uint32_t	free_slots;	/* index + 1 of the first free slot */
+};
+
+inline thread_local worker_state tls;
+
+struct worker_reaper {
+	~worker_reaper()
+	{
+		frame *slab;
+
+		while ((slab = tls.slabs)) {
+			tls.slabs = slab->next;
+			std::free(slab);
+		}
+		std::free(tls.slots);
+		std::memset(&tls, 0, sizeof(tls));
+	}
+};
+
+inline thread_local worker_reaper reaper;
+
+[[noreturn]] inline void oom()
+{
+	perror("OOM");
+	exit(1);
+}
+
+/* Carve a new slab into class cls frames, keeping the first word for the slab list */
+inline void frame_refill(size_t cls)
+{
+	size_t sz = cls * FRAME_GRAIN;
+	size_t nr = (FRAME_SLAB - FRAME_GRAIN) / sz;
+	frame *slab;
+	char *p;
+
+	(void)&reaper;
+	if (!nr)
+		nr = 1;
+	slab = static_cast<frame *>(std::malloc(FRAME_GRAIN + nr * sz));
+	if (!slab)
+		oom();
+	slab->next = tls.slabs;
+	tls.slabs  = slab;
+
+	p = reinterpret_cast<char *>(slab) + FRAME_GRAIN;
+	for (size_t i = 0; i < nr; i++, p += sz) {
+		frame *f = reinterpret_cast<frame *>(p);
+
+		f->next = tls.free[cls];
+		tls.free[cls] = f;
+	}
+}
+
+inline void *frame_alloc(size_t sz)
+{
+	size_t cls = (sz + FRAME_GRAIN - 1) / FRAME_GRAIN;
+	frame *f;
+	void *p;
+
+	if (cls >= FRAME_CLASSES) {
+		p = std::malloc(sz);
+		if (!p)
+			oom();
+		return p;
+	}
+
+	if (!tls.free[cls])
+		frame_refill(cls);
+	f = tls.free[cls];
+	tls.free[cls] = f->next;
+	return f;
+}
+
+inline void frame_free(void *p, size_t sz)
+{
+	size_t cls = (sz + FRAME_GRAIN - 1) / FRAME_GRAIN;
+	frame *f = static_cast<frame *>(p);
+
+	if (cls >= FRAME_CLASSES) {
+		std::free(p);
+		return;
+	}
+	f->next = tls.free[cls];
+	tls.free[cls] = f;
+}
+
+/* Double the slot table, the same way add_writev grows its own */
+inline void slots_grow()
+{
+	uint32_t max = tls.nr_slots ? 2 * tls.nr_slots : 1024;
+	await_slot *slots;
+
+	(void)&reaper;
+	slots = static_cast<await_slot *>(std::realloc(tls.slots, max * sizeof(await_slot)));
+	if (!slots)
+		oom();
+	for (uint32_t i = max; i-- > tls.nr_slots; ) {
+		slots[i].await = nullptr;
+		slots[i].gen   = 0;
+		slots[i].next  = tls.free_slots;
+		tls.free_slots = i + 1;
+	}
+	tls.slots    = slots;
+	tls.nr_slots = max;
+}
+
+inline uint64_t slot_get(io_await *a)
+{
+	await_slot *slot;
+
+	if (!tls.free_slots)
+		slots_grow();
+	slot = &tls.slots[tls.free_slots - 1];
+	tls.free_slots = slot->next;
+	slot->await = a;
+	return static_cast<uint64_t>(slot->gen) << 32 |
+	       static_cast<uint32_t>(slot - tls.slots);
+}
+
+/* Give cookie's slot back: its awaiter, or nullptr if it is not live */
+inline io_await *slot_put(uint64_t cookie)
+{
+	uint32_t idx = static_cast<uint32_t>(cookie);
+	await_slot *slot;
+	io_await *a;
+
+	if (idx >= tls.nr_slots)
+		return nullptr;
+	slot = &tls.slots[idx];
+	if (!slot->await || slot->gen != cookie >> 32)
+		return nullptr;
+
+	a = slot->await;
+	slot->await = nullptr;
+	slot->gen++;
+	slot->next = tls.free_slots;
+	tls.free_slots = idx + 1;
+	return a;
+}
+
+/*
+ * Common part of the fd awaiters: park in a slot, tag the action with its
+ * cookie and queue it with complete() as work_fn, which hands the
+ * completion over and resumes.  The coroutine may finish, and free the
+ * awaiter with its frame, inside resume(), so nothing touches it after.
+ */
+class io_await {
+public:
+	bool await_ready() const noexcept { return false; }
+	struct up_event await_resume() const noexcept { return evt_; }
+
+protected:
+	explicit io_await(int fd) noexcept : fd_(fd) { evt_.fd = fd; }
+
+	uint64_t park(std::coroutine_handle<> h)
+	{
+		h_ = h;
+		return slot_get(this);
+	}
+
+	static void complete(struct up_event *evt)
+	{
+		io_await *a = slot_put(evt->user_data);
+
+		if (!a) {
+			drop(evt);
+			return;
+		}
+		a->evt_ = *evt;
+		a->h_.resume();
+	}
+
+	/* Nobody waits for evt: give back what it brought */
+	static void drop(struct up_event *evt)
+	{
+		if (evt->type == UP_READ && evt->buf)
+			return_buffer(evt->buf, evt->len);
+		else if (evt->type == UP_ACCEPT && evt->result >= 0)
+			close(evt->result);
+	}
+
+	int			fd_;
+	struct up_event		evt_ = {};
+	std::coroutine_handle<>	h_;
+};
+
+} /* namespace detail */
+
+/*
+ * A detached coroutine: it runs until its first co_await when called and
+ * frees itself when it returns.  There is nobody to rethrow to, so an
+ * exception escaping a task terminates the process.
+ */
+struct task {
+	struct promise_type {
+		static void *operator new(size_t sz) { return detail::frame_alloc(sz); }
+		static void operator delete(void *p, size_t sz) { detail::frame_free(p, sz); }
+
+		task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+/* co_await io.read(fd): add_read(), yields the UP_READ completion */
+class read_await : public detail::io_await {
+public:
+	explicit read_await(int fd) noexcept : io_await(fd) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		add_read_data(fd_, complete, park(h));
+	}
+};
+
+/*
+ * A multishot read registration, add_read_multishot_data(), for a loop
+ * that reads one fd over and over without queueing a read each time:
+ *
+ *	upcall::reader rd(fd);
+ *
+ *	for (;;) {
+ *		struct up_event evt = co_await rd.read();
+ *		...
+ *	}
+ *
+ * The first read() registers, and the read() after a completion that
+ * ended the registration (UP_F_LAST) registers again.  Completions that
+ * arrive while the coroutine waits on something else are kept, in order,
+ * for the next read().  The reader is the fd's read; completions find it
+ * through their user_data, so it must not go out of scope while its
+ * registration is live: read until UP_F_LAST, or co_await rd.cancel(),
+ * which ends the registration and gives back the buffers of completions
+ * nobody read.  On the kernel backend a read already submitted cannot be
+ * taken back, so there cancel() waits for it to complete.
+ */
+class reader {
+public:
+	explicit reader(int fd) noexcept : fd_(fd) {}
+	reader(const reader &) = delete;
+	reader &operator=(const reader &) = delete;
+
+	~reader()
+	{
+		if (live_)
+			std::terminate();
+		std::free(queue_);
+	}
+
+	class read_op {
+	public:
+		explicit read_op(reader &r) noexcept : r_(r) {}
+
+		bool await_ready() const noexcept { return r_.cnt_; }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			if (!r_.live_) {
+				r_.live_ = true;
+				add_read_multishot_data(r_.fd_, done,
+							reinterpret_cast<uintptr_t>(&r_));
+			}
+			r_.h_ = h;
+		}
+
+		struct up_event await_resume() noexcept
+		{
+			return r_.cnt_ ? r_.pop() : r_.evt_;
+		}
+
+	private:
+		reader &r_;
+	};
+
+	class cancel_op {
+	public:
+		explicit cancel_op(reader &r) noexcept : r_(r) {}
+
+		bool await_ready() noexcept
+		{
+			while (r_.cnt_)
+				drop(r_.pop());
+			return !r_.live_;
+		}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			r_.cancelling_ = true;
+			r_.h_ = h;
+			add_cancel_data(r_.fd_, nullptr, reinterpret_cast<uintptr_t>(&r_));
+		}
+
+		void await_resume() const noexcept {}
+
+	private:
+		reader &r_;
+	};
+
+	read_op read() noexcept { return read_op(*this); }
+	cancel_op cancel() noexcept { return cancel_op(*this); }
+
+private:
+	static void drop(const struct up_event &evt)
+	{
+		if (evt.buf)
+			return_buffer(evt.buf, evt.len);
+	}
+
+	/* Resuming may end the coroutine and free the reader, so it goes last */
+	static void done(struct up_event *evt)
+	{
+		reader *r = reinterpret_cast<reader *>(evt->user_data);
+		std::coroutine_handle<> h = r->h_;
+		bool last = evt->flags & UP_F_LAST;
+
+		if (last)
+			r->live_ = false;
+
+		if (r->cancelling_) {
+			drop(*evt);
+			if (!last)
+				return;
+			r->cancelling_ = false;
+		} else if (!h) {
+			r->push(*evt);
+			return;
+		}
+
+		r->h_   = nullptr;
+		r->evt_ = *evt;
+		h.resume();
+	}
+
+	void push(const struct up_event &evt)
+	{
+		if (cnt_ == max_) {
+			struct up_event *q;
+			int max = max_ ? 2 * max_ : 4;
+
+			q = static_cast<struct up_event *>(std::malloc(max * sizeof(*q)));
+			if (!q)
+				detail::oom();
+			for (int i = 0; i < cnt_; i++)
+				q[i] = queue_[(head_ + i) % max_];
+			std::free(queue_);
+			queue_ = q;
+			max_   = max;
+			head_  = 0;
+		}
+		queue_[(head_ + cnt_++) % max_] = evt;
+	}
+
+	struct up_event pop() noexcept
+	{
+		struct up_event evt = queue_[head_];
+
+		head_ = (head_ + 1) % max_;
+		cnt_--;
+		return evt;
+	}
+
+	int			fd_;
+	bool			live_ = false;
+	bool			cancelling_ = false;
+	std::coroutine_handle<>	h_;
+	struct up_event		evt_ = {};
+	struct up_event		*queue_ = nullptr;
+	int			head_ = 0;
+	int			cnt_ = 0;
+	int			max_ = 0;
+};
+
+/* co_await io.accept(fd): add_accept(), evt.result is the new fd or -errno */
+class accept_await : public detail::io_await {
+public:
+	explicit accept_await(int fd) noexcept : io_await(fd) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		add_accept_data(fd_, complete, park(h));
+	}
+};
+
+/*
+ * co_await io.poll(fd, events): add_poll(), evt.result is the ready
+ * events or -errno.
+ */
+class poll_await : public detail::io_await {
+public:
+	poll_await(int fd, uint32_t events) noexcept : io_await(fd), events_(events) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		add_poll_data(fd_, events_, complete, park(h));
+	}
+
+private:
+	uint32_t events_;
+};
+
+/*
+ * co_await io.write(fd, buf, len): the whole buffer goes out (through
+ * add_writev(), which finishes short writes), evt.result is len or the
+ * 0 / -errno that stopped it.  buf must stay valid until then.
+ */
+class write_await : public detail::io_await {
+public:
+	write_await(int fd, const void *buf, size_t len) noexcept
+		: io_await(fd), iov_{const_cast<void *>(buf), len} {}
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		uint64_t cookie = park(h);
+		int ret;
+
+		ret = add_writev_data(fd_, &iov_, 1, complete, cookie);
+		if (ret) {
+			detail::slot_put(cookie);
+			evt_.type   = UP_WRITEV;
+			evt_.result = ret;
+			return false;
+		}
+		return true;
+	}
+
+private:
+	struct iovec iov_;
+};
+
+/*
+ * co_await io.connect(fd, addr, addrlen): add_connect(), evt.result is 0
+ * or -errno.  addr must stay valid until then.
+ */
+class connect_await : public detail::io_await {
+public:
+	connect_await(int fd, const struct sockaddr *addr, socklen_t addrlen) noexcept
+		: io_await(fd), addr_(addr), addrlen_(addrlen) {}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		add_connect_data(fd_, addr_, addrlen_, complete, park(h));
+	}
+
+private:
+	const struct sockaddr	*addr_;
+	socklen_t		addrlen_;
+};
+
+/* co_await io.sleep(usecs): add_timer(), yields the UP_TIMEOUT event */
+class sleep_await {
+public:
+	explicit sleep_await(uint64_t usecs) noexcept : usecs_(usecs) {}
+
+	bool await_ready() const noexcept { return false; }
+	struct up_event await_resume() const noexcept { return evt_; }
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		h_ = h;
+		add_timer(&timer_, usecs_, done, this);
+	}
+
+private:
+	static void done(struct up_event *evt)
+	{
+		sleep_await *s = static_cast<sleep_await *>(evt->buf);
+
+		s->evt_ = *evt;
+		s->h_.resume();
+	}
+
+	uint64_t		usecs_;
+	struct upcall_timer	timer_ = {};
+	struct up_event		evt_ = {};
+	std::coroutine_handle<>	h_;
+};
+
+/*
+ * The awaitable versions of the callback-facing API.  Stateless; a handler
+ * just declares one.
+ */
+struct io {
+	read_await read(int fd) const noexcept { return read_await(fd); }
+	accept_await accept(int fd) const noexcept { return accept_await(fd); }
+	write_await write(int fd, const void *buf, size_t len) const noexcept
+	{
+		return write_await(fd, buf, len);
+	}
+	poll_await poll(int fd, uint32_t events) const noexcept
+	{
+		return poll_await(fd, events);
+	}
+	connect_await connect(int fd, const struct sockaddr *addr,
+			      socklen_t addrlen) const noexcept
+	{
+		return connect_await(fd, addr, addrlen);
+	}
+	sleep_await sleep(uint64_t usecs) const noexcept { return sleep_await(usecs); }
+};
+
+} /* namespace upcall */
+
+#endif
@@ -0,0 +1,823 @@
+/**
+ * Upcall support library - epoll emulation backend
+ * Copyright (C) 2024 Eric B Munson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * This backend implements upcall_create/upcall_submit on top of epoll so
+ * that libupcall can run on a stock kernel.  Every submitted action is
+ * attempted immediately; anything that would block is parked on a per-fd
+ * queue and the fd is armed with EPOLLONESHOT.  UP_F_MULTISHOT actions
+ * simply stay on their queue until they complete with an end-of-file or
+ * an error.  Completions are returned in the order they happened and
+ * anything that does not fit in the caller's receive array is held for
+ * the next submit.
+ *
+ * All state is per thread: every libupcall worker shares one upfd, but
+ * each one gets a private epoll instance, buffer pool and completion
+ * queue, just as each worker's completions are private in the kernel.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "upcall_int.h"
+
+#define EMUL_EVTS 64
+
+struct emul_op {
+	struct emul_op	*next;
+	struct up_event	evt;
+};
+
+struct emul_queue {
+	struct emul_op	*head;
+	struct emul_op	*tail;
+};
+
+struct emul_fd {
+	struct emul_queue	in;		/* UP_READ and UP_ACCEPT */
+	struct emul_queue	out;		/* UP_WRITE(V), UP_CONNECT, UP_SHUTDOWN,
+						 * UP_SENDFILE */
+	struct emul_queue	poll;		/* UP_POLL, each one independent */
+	uint32_t		armed;		/* events armed and not yet fired */
+	bool			registered;	/* fd has been added to epfd */
+};
+
+static __thread int epfd = -1;
+static __thread struct emul_fd *fds;
+static __thread int fds_max;
+static __thread struct emul_op *free_ops;
+
+/*
+ * Buffers handed over with UP_VEC, one pool per size class (the UP_VEC's
+ * fd), used LIFO to keep them cache warm.  sz is the largest buffer the
+ * class has been given.
+ */
+struct emul_pool {
+	struct iovec	*iov;
+	int		cnt;
+	int		max;
+	size_t		sz;
+};
+
+static __thread struct emul_pool pools[UPCALL_BUF_CLASSES];
+
+/* Completions not yet copied out to the caller, a ring of done_max */
+static __thread struct up_event *done;
+static __thread int done_head;
+static __thread int done_cnt;
+static __thread int done_max;
+
+static void emul_oom(void)
+{
+	perror("OOM");
+	exit(1);
+}
+
+static struct emul_fd *emul_fd_get(int fd)
+{
+	int max = fds_max ? fds_max : 1024;
+
+	if (fd < fds_max)
+		return &fds[fd];
+
+	while (max <= fd)
+		max *= 2;
+	fds = realloc(fds, max * sizeof(struct emul_fd));
+	if (!fds)
+		emul_oom();
+	memset(&fds[fds_max], 0, (max - fds_max) * sizeof(struct emul_fd));
+	fds_max = max;
+	return &fds[fd];
+}
+
+static struct emul_op *emul_op_alloc(void)
+{
+	struct emul_op *op = free_ops;
+
+	if (op) {
+		free_ops = op->next;
+		return op;
+	}
+
+	op = malloc(sizeof(struct emul_op));
+	if (!op)
+		emul_oom();
+	return op;
+}
+
+static void emul_op_free(struct emul_op *op)
+{
+	op->next = free_ops;
+	free_ops = op;
+}
+
+static void emul_complete(struct up_event *evt, int32_t result)
+{
+	struct up_event *fresh;
+	int max;
+
+	if (done_cnt == done_max) {
+		max = done_max ? 2 * done_max : EMUL_EVTS;
+		fresh = malloc(max * sizeof(struct up_event));
+		if (!fresh)
+			emul_oom();
+		for (int i = 0; i < done_cnt; i++)
+			fresh[i] = done[(done_head + i) % done_max];
+		free(done);
+		done      = fresh;
+		done_head = 0;
+		done_max  = max;
+	}
+
+	evt->result = result;
+	done[(done_head + done_cnt) % done_max] = *evt;
+	done_cnt++;
+}
+
+static int emul_add_buffers(int cls, struct iovec *bufs, size_t cnt)
+{
+	struct emul_pool *p;
+
+	if (cls < 0 || cls >= UPCALL_BUF_CLASSES)
+		return -EINVAL;
+	p = &pools[cls];
+
+	if (p->cnt + cnt > p->max) {
+		p->max = p->cnt + cnt;
+		p->iov = realloc(p->iov, p->max * sizeof(struct iovec));
+		if (!p->iov)
+			emul_oom();
+	}
+	memcpy(&p->iov[p->cnt], bufs, cnt * sizeof(struct iovec));
+	p->cnt += cnt;
+	for (size_t i = 0; i < cnt; i++)
+		if (bufs[i].iov_len > p->sz)
+			p->sz = bufs[i].iov_len;
+	return 0;
+}
+
+/*
+ * The pool a read with size hint len takes its buffer from: the smallest
+ * class with buffers that can hold len, else the largest class with any
+ * buffers.  A hint of 0 asks for the largest.  NULL if every pool is dry.
+ */
+static struct emul_pool *emul_pick_pool(uint64_t len)
+{
+	struct emul_pool *fit = NULL;
+	struct emul_pool *big = NULL;
+
+	for (int c = 0; c < UPCALL_BUF_CLASSES; c++) {
+		struct emul_pool *p = &pools[c];
+
+		if (!p->cnt)
+			continue;
+		if (len && p->sz >= len && (!fit || p->sz < fit->sz))
+			fit = p;
+		if (!big || p->sz > big->sz)
+			big = p;
+	}
+	return fit ? fit : big;
+}
+
+/*
+ * Try to carry out evt.  Returns false if the fd is not ready and the
+ * action must wait for epoll, true once a completion has been queued.
+ * 'ready' is set when epoll has just reported the fd, which is the only
+ * time an empty buffer pool is reported as -ENOMEM, matching the kernel
+ * which only needs a buffer once data has arrived.
+ *
+ * A read's len is its size hint going in and the size of the buffer it
+ * filled coming out; completions without a buffer leave it alone so a
+ * re-armed read asks for the same class.
+ */
+static bool emul_perform(struct up_event *evt, bool ready)
+{
+	struct up_file_io *fio;
+	struct emul_pool *p;
+	struct msghdr msg;
+	struct iovec iov;
+	socklen_t len;
+	ssize_t ret;
+	size_t n;
+	int err;
+
+	switch (evt->type) {
+	case UP_READ:
+		p = emul_pick_pool(evt->len);
+		if (!p) {
+			if (!ready)
+				return false;
+			evt->buf = NULL;
+			emul_complete(evt, -ENOMEM);
+			return true;
+		}
+
+		iov = p->iov[--p->cnt];
+		ret = read(evt->fd, iov.iov_base, iov.iov_len);
+		if (ret > 0) {
+			evt->buf = iov.iov_base;
+			evt->len = iov.iov_len;
+			emul_complete(evt, ret);
+			return true;
+		}
+
+		/* Nothing was read, so the buffer stays in the pool */
+		p->iov[p->cnt++] = iov;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		evt->buf = NULL;
+		emul_complete(evt, ret < 0 ? -errno : 0);
+		return true;
+
+	case UP_ACCEPT:
+		ret = accept4(evt->fd, NULL, NULL, SOCK_NONBLOCK);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		emul_complete(evt, ret < 0 ? -errno : ret);
+		return true;
+
+	case UP_WRITE:
+		ret = send(evt->fd, evt->buf, evt->len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == ENOTSOCK)
+			ret = write(evt->fd, evt->buf, evt->len);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		emul_complete(evt, ret < 0 ? -errno : ret);
+		return true;
+
+	case UP_WRITEV:
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = evt->buf;
+		msg.msg_iovlen = evt->len;
+		ret = sendmsg(evt->fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0 && errno == ENOTSOCK)
+			ret = writev(evt->fd, evt->buf, evt->len);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		emul_complete(evt, ret < 0 ? -errno : ret);
+		return true;
+
+	case UP_CONNECT:
+		/*
+		 * The first attempt starts the connect and marks the op with
+		 * -EINPROGRESS; after that only EPOLLOUT (or an error) on the
+		 * socket means it has finished, and SO_ERROR says how.
+		 */
+		if (evt->result != -EINPROGRESS) {
+			ret = connect(evt->fd, evt->buf, evt->len);
+			if (ret < 0 && errno == EINPROGRESS) {
+				evt->result = -EINPROGRESS;
+				return false;
+			}
+			emul_complete(evt, ret < 0 ? -errno : 0);
+			return true;
+		}
+
+		if (!ready)
+			return false;
+		len = sizeof(err);
+		if (getsockopt(evt->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			err = errno;
+		emul_complete(evt, -err);
+		return true;
+
+	case UP_SHUTDOWN:
+		ret = shutdown(evt->fd, evt->len);
+		emul_complete(evt, ret < 0 ? -errno : 0);
+		return true;
+
+	/*
+	 * Files are always "ready" to epoll, so positional I/O is done on the
+	 * spot, which only stalls the worker on a page cache miss.
+	 */
+	case UP_PREAD:
+	case UP_PWRITE:
+		fio = evt->buf;
+		n = fio->len > INT32_MAX ? INT32_MAX : fio->len;
+		if (evt->type == UP_PREAD)
+			ret = pread(evt->fd, fio->buf, n, fio->off);
+		else
+			ret = pwrite(evt->fd, fio->buf, n, fio->off);
+		emul_complete(evt, ret < 0 ? -errno : ret);
+		return true;
+
+	/* evt->result carries the bytes sent while the socket fills up */
+	case UP_SENDFILE:
+		fio = evt->buf;
+		while (fio->len && evt->result < INT32_MAX) {
+			n = fio->len;
+			if (n > (uint64_t)(INT32_MAX - evt->result))
+				n = INT32_MAX - evt->result;
+			ret = sendfile(evt->fd, fio->file_fd, (off_t *)&fio->off, n);
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return false;
+			if (ret < 0) {
+				emul_complete(evt, -errno);
+				return true;
+			}
+			if (!ret)
+				break;
+			fio->len    -= ret;
+			evt->result += ret;
+		}
+		emul_complete(evt, evt->result);
+		return true;
+
+	default:
+		emul_complete(evt, -EINVAL);
+		return true;
+	}
+}
+
+static void emul_enqueue(struct emul_queue *q, struct up_event *evt)
+{
+	struct emul_op *op = emul_op_alloc();
+
+	op->evt  = *evt;
+	op->next = NULL;
+	if (q->tail)
+		q->tail->next = op;
+	else
+		q->head = op;
+	q->tail = op;
+}
+
+/*
+ * Run the queue until its head would block.  A live multishot action stays
+ * at the head and keeps completing until the fd runs dry; 'ready' only
+ * describes the first attempt, later ones must find data for themselves.
+ */
+static void emul_run_queue(struct emul_queue *q, bool ready)
+{
+	struct emul_op *op;
+
+	while ((op = q->head)) {
+		if (!emul_perform(&op->evt, ready))
+			break;
+		ready = false;
+
+		if (!up_event_final(&op->evt)) {
+			/* Out of buffers: leave the rest for the next submit */
+			if (op->evt.result == -ENOMEM)
+				break;
+			continue;
+		}
+
+		q->head = op->next;
+		if (!q->head)
+			q->tail = NULL;
+		emul_op_free(op);
+	}
+}
+
+static void emul_fail_queue(struct emul_queue *q, int err)
+{
+	struct emul_op *op;
+
+	while ((op = q->head)) {
+		q->head = op->next;
+		/* A live multishot read still points at its last buffer */
+		if (op->evt.type == UP_READ)
+			op->evt.buf = NULL;
+		emul_complete(&op->evt, -err);
+		emul_op_free(op);
+	}
+	q->tail = NULL;
+}
+
+/*
+ * Hand epoll's events to every UP_POLL waiting for one of them.  Unlike
+ * the other queues the polls do not wait on each other, and multishot
+ * ones stay queued, so a level that stays high is reported again on
+ * every submit until the application deals with it.
+ */
+static void emul_run_polls(struct emul_queue *q, uint32_t events)
+{
+	struct emul_op **pp = &q->head;
+	struct emul_op *op;
+	uint32_t mask;
+
+	q->tail = NULL;
+	while ((op = *pp)) {
+		mask = events & (op->evt.len | EPOLLERR | EPOLLHUP);
+		if (mask)
+			emul_complete(&op->evt, mask);
+		if (mask && up_event_final(&op->evt)) {
+			*pp = op->next;
+			emul_op_free(op);
+			continue;
+		}
+		q->tail = op;
+		pp = &op->next;
+	}
+}
+
+/* Everything the fd's polls are waiting for */
+static uint32_t emul_poll_events(struct emul_queue *q)
+{
+	uint32_t want = 0;
+
+	for (struct emul_op *op = q->head; op; op = op->next)
+		want |= op->evt.len;
+	return want;
+}
+
+/*
+ * Make sure epoll will report every event the fd's queues are waiting on.
+ * Registrations are one-shot, so a fd that has fired needs exactly one
+ * epoll_ctl to wait again and an idle fd never wakes the worker.  A fd
+ * that was closed and reused drops out of epoll behind our back, which
+ * shows up as ENOENT on the MOD and is fixed with an ADD.
+ */
+static void emul_arm(int fd, struct emul_fd *efd)
+{
+	struct epoll_event ev;
+	uint32_t want = 0;
+	int ret;
+
+	if (efd->in.head)
+		want |= EPOLLIN;
+	if (efd->out.head)
+		want |= EPOLLOUT;
+	if (efd->poll.head)
+		want |= emul_poll_events(&efd->poll);
+	if (!(want & ~efd->armed))
+		return;
+
+	want |= efd->armed;
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = want | EPOLLONESHOT;
+	ev.data.fd = fd;
+
+	ret = epoll_ctl(epfd, efd->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+			fd, &ev);
+	if (ret && errno == ENOENT)
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	else if (ret && errno == EEXIST)
+		ret = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+
+	if (ret) {
+		/* Not pollable (or not open), nothing queued can ever finish */
+		efd->registered = false;
+		efd->armed      = 0;
+		emul_fail_queue(&efd->in, errno);
+		emul_fail_queue(&efd->out, errno);
+		emul_fail_queue(&efd->poll, errno);
+		return;
+	}
+
+	efd->registered = true;
+	efd->armed      = want;
+}
+
+/* Give a read's buffer back to the class it was taken from */
+static void emul_pool_put(void *buf, uint64_t len)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	int cls = -1;
+
+	for (int c = 0; c < UPCALL_BUF_CLASSES; c++)
+		if (pools[c].sz >= len && (cls < 0 || pools[c].sz < pools[cls].sz))
+			cls = c;
+	emul_add_buffers(cls < 0 ? 0 : cls, &iov, 1);
+}
+
+/*
+ * Take the input completions cancel hits back out of the done ring.  Their
+ * buffers return to the pool and accepted sockets are closed; one that
+ * ended its registration stays as the -ECANCELED, the rest go, as the
+ * registration still queued will be failed with it.
+ */
+static void emul_scrub_done(const struct up_event *cancel)
+{
+	struct up_event *evt;
+	int kept = 0;
+
+	for (int i = 0; i < done_cnt; i++) {
+		evt = &done[(done_head + i) % done_max];
+		if (up_cancel_hits(cancel, evt) && up_action_input(evt->type)) {
+			if (evt->type == UP_READ && evt->buf) {
+				emul_pool_put(evt->buf, evt->len);
+				evt->buf = NULL;
+			} else if (evt->type == UP_ACCEPT && evt->result >= 0) {
+				close(evt->result);
+			}
+			if (!up_event_final(evt))
+				continue;
+			evt->result = -ECANCELED;
+		}
+		done[(done_head + kept++) % done_max] = *evt;
+	}
+	done_cnt = kept;
+}
+
+/* Fail the queued actions cancel hits, keeping the rest in order */
+static void emul_cancel_queue(struct emul_queue *q,
+			      const struct up_event *cancel)
+{
+	struct emul_op **pp = &q->head;
+	struct emul_op *op;
+
+	q->tail = NULL;
+	while ((op = *pp)) {
+		if (!up_cancel_hits(cancel, &op->evt)) {
+			q->tail = op;
+			pp = &op->next;
+			continue;
+		}
+		*pp = op->next;
+		/* A live multishot read still points at its last buffer */
+		if (op->evt.type == UP_READ)
+			op->evt.buf = NULL;
+		emul_complete(&op->evt, -ECANCELED);
+		emul_op_free(op);
+	}
+}
+
+/*
+ * Cancel what is outstanding on cancel's fd (only what carries its
+ * user_data under UP_F_MATCH), none of which still queued holds a pool
+ * buffer yet.  epoll may still report the fd once more, which finds
+ * nothing to do and does not re-arm it.
+ */
+static void emul_cancel_fd(const struct up_event *cancel)
+{
+	struct emul_fd *efd;
+
+	emul_scrub_done(cancel);
+	if (cancel->fd >= fds_max)
+		return;
+	efd = &fds[cancel->fd];
+	emul_cancel_queue(&efd->in, cancel);
+	emul_cancel_queue(&efd->out, cancel);
+	emul_cancel_queue(&efd->poll, cancel);
+}
+
+/*
+ * UP_CLOSE cancels whatever is outstanding on the fd, then closes it.
+ * Closing drops the fd from epoll, so only our own bookkeeping needs
+ * resetting for whoever gets it next.
+ */
+static void emul_close(struct up_event *evt)
+{
+	struct up_event all = { .fd = evt->fd };
+
+	emul_cancel_fd(&all);
+	if (evt->fd < fds_max) {
+		fds[evt->fd].registered = false;
+		fds[evt->fd].armed      = 0;
+	}
+	emul_complete(evt, close(evt->fd) ? -errno : 0);
+}
+
+static void emul_queue_action(struct up_event *evt)
+{
+	struct emul_fd *efd;
+	struct emul_queue *q;
+
+	if (evt->fd < 0) {
+		emul_complete(evt, -EBADF);
+		return;
+	}
+
+	if (evt->type == UP_CLOSE) {
+		emul_close(evt);
+		return;
+	}
+
+	if (evt->type == UP_CANCEL) {
+		emul_cancel_fd(evt);
+		emul_complete(evt, 0);
+		return;
+	}
+
+	efd = emul_fd_get(evt->fd);
+
+	/* Readiness is only ever learnt from epoll */
+	if (evt->type == UP_POLL) {
+		evt->len &= EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLRDHUP;
+		emul_enqueue(&efd->poll, evt);
+		emul_arm(evt->fd, efd);
+		return;
+	}
+
+	/* Regular files cannot join epoll: done on the spot, however long it takes */
+	if (evt->type == UP_PREAD || evt->type == UP_PWRITE) {
+		emul_perform(evt, false);
+		return;
+	}
+
+	q   = (evt->type == UP_WRITE || evt->type == UP_WRITEV ||
+	       evt->type == UP_CONNECT || evt->type == UP_SHUTDOWN ||
+	       evt->type == UP_SENDFILE) ? &efd->out : &efd->in;
+
+	/* Keep per-fd ordering: only try it now if nothing is ahead of it */
+	if (!q->head) {
+		if (evt->flags & UP_F_MULTISHOT) {
+			emul_enqueue(q, evt);
+			emul_run_queue(q, false);
+			if (q->head)
+				emul_arm(evt->fd, efd);
+			return;
+		}
+		if (emul_perform(evt, false))
+			return;
+	}
+
+	/* One failed attempt is enough, the next one waits for epoll */
+	emul_enqueue(q, evt);
+	emul_arm(evt->fd, efd);
+}
+
+static int emul_poll(int timeout)
+{
+	struct epoll_event evs[EMUL_EVTS];
+	struct emul_fd *efd;
+	uint32_t events;
+	int ret;
+
+	ret = epoll_wait(epfd, evs, EMUL_EVTS, timeout);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (int i = 0; i < ret; i++) {
+		efd    = emul_fd_get(evs[i].data.fd);
+		events = evs[i].events;
+		efd->armed = 0;
+
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			emul_run_queue(&efd->in, true);
+		if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			emul_run_queue(&efd->out, true);
+		if (efd->poll.head)
+			emul_run_polls(&efd->poll, events);
+		emul_arm(evs[i].data.fd, efd);
+	}
+	return 0;
+}
+
+static int emul_create(int flags)
+{
+	if (flags & ~UPCALL_MASK) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * The returned fd is only a handle; the real state is created per
+	 * thread on first submit.
+	 */
+	return eventfd(0, (flags & O_CLOEXEC) ? EFD_CLOEXEC : 0);
+}
+
+static int emul_submit_common(int in_cnt, struct up_event *in,
+			      int out_cnt, struct up_event *out, bool wait)
+{
+	struct up_event evt;
+	int cnt;
+
+	if (in_cnt < 0 || out_cnt < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (epfd < 0) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+			return -1;
+	}
+
+	for (int i = 0; i < in_cnt; i++) {
+		if (in[i].type == UP_VEC) {
+			if (emul_add_buffers(in[i].fd, (struct iovec *)in[i].buf,
+					     in[i].len)) {
+				errno = EINVAL;
+				return -1;
+			}
+			continue;
+		}
+		evt = in[i];
+		emul_queue_action(&evt);
+	}
+
+	if (!wait) {
+		if (!done_cnt && out_cnt && emul_poll(0))
+			return -1;
+	} else {
+		while (!done_cnt && out_cnt) {
+			if (emul_poll(-1))
+				return -1;
+		}
+	}
+
+	cnt = done_cnt < out_cnt ? done_cnt : out_cnt;
+	for (int i = 0; i < cnt; i++) {
+		out[i] = done[done_head];
+		done_head = (done_head + 1) % done_max;
+	}
+	done_cnt -= cnt;
+	return cnt;
+}
+
+static int emul_submit(int upfd, int in_cnt, struct up_event *in,
+		       int out_cnt, struct up_event *out)
+{
+	return emul_submit_common(in_cnt, in, out_cnt, out, true);
+}
+
+static int emul_submit_nowait(int upfd, int in_cnt, struct up_event *in,
+			      int out_cnt, struct up_event *out)
+{
+	return emul_submit_common(in_cnt, in, out_cnt, out, false);
+}
+
+static void emul_free_queue(struct emul_queue *q)
+{
+	struct emul_op *op;
+
+	while ((op = q->head)) {
+		q->head = op->next;
+		free(op);
+	}
+	q->tail = NULL;
+}
+
+static void emul_release(void)
+{
+	struct emul_op *op;
+
+	if (epfd >= 0)
+		close(epfd);
+	epfd = -1;
+
+	for (int i = 0; i < fds_max; i++) {
+		emul_free_queue(&fds[i].in);
+		emul_free_queue(&fds[i].out);
+		emul_free_queue(&fds[i].poll);
+	}
+	free(fds);
+	fds     = NULL;
+	fds_max = 0;
+
+	while ((op = free_ops)) {
+		free_ops = op->next;
+		free(op);
+	}
+
+	for (int c = 0; c < UPCALL_BUF_CLASSES; c++)
+		free(pools[c].iov);
+	memset(pools, 0, sizeof(pools));
+
+	free(done);
+	done      = NULL;
+	done_head = done_cnt = done_max = 0;
+}
+
+const struct upcall_backend upcall_epoll_backend = {
+	.name          = "epoll",
+	.create        = emul_create,
+	.submit        = emul_submit,
+	.submit_nowait = emul_submit_nowait,
+	.release       = emul_release,
+	.multishot     = true,
+	.writev        = true,
+	.classes       = true,
+	.close         = true,
+	.actions       = UP_ACTION(UP_READ) | UP_ACTION(UP_WRITE) |
+			 UP_ACTION(UP_ACCEPT) | UP_ACTION(UP_VEC) |
+			 UP_ACTION(UP_WRITEV) | UP_ACTION(UP_CONNECT) |
+			 UP_ACTION(UP_CLOSE) | UP_ACTION(UP_SHUTDOWN) |
+			 UP_ACTION(UP_POLL) | UP_ACTION(UP_PREAD) |
+			 UP_ACTION(UP_PWRITE) | UP_ACTION(UP_SENDFILE) |
+			 UP_ACTION(UP_CANCEL),
+};
@@ -0,0 +1,132 @@
+/**
+ * Upcall support library - internal definitions
+ * Copyright (C) 2024 Eric B Munson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef UPCALL_INT_H_
+#define UPCALL_INT_H_
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "upcall.h"
+
+/*
+ * A backend provides the two entry points of the upcall ABI.  The kernel
+ * backend calls the real syscalls; the epoll backend emulates the same
+ * submit/complete semantics in user space so libupcall and its users can
+ * run on a stock kernel.
+ *
+ * 'multishot' is set when the backend keeps UP_F_MULTISHOT registrations
+ * alive by itself; otherwise libupcall re-arms them after each completion.
+ * 'writev' is set when the backend understands UP_WRITEV; otherwise
+ * libupcall issues one UP_WRITE per iovec.  'classes' is set when it keeps
+ * one pool per UP_VEC fd (the size class); otherwise it has the single
+ * pool of the original ABI and only one class can be set up.  'close' is
+ * set when it carries UP_CLOSE and UP_SHUTDOWN; otherwise libupcall makes
+ * the close() or shutdown() call itself and completes the action locally.
+ *
+ * 'submit_nowait' (may be NULL) is submit that returns 0 instead of
+ * waiting when nothing has completed yet; workers only busy poll on
+ * backends that have it.  The kernel backend drops it when a probe at
+ * init finds the kernel does not honour UPCALL_SUBMIT_NOWAIT.
+ *
+ * 'release' (may be NULL) frees whatever the backend keeps for the calling
+ * thread; a worker calls it on its way out of upcall_ctx_fini().
+ *
+ * 'cancel' (may be NULL) is for a backend without UP_CANCEL.  libupcall
+ * cancels what it has not submitted yet itself, and calls this for the
+ * input actions the backend already holds: each that cancel hits comes
+ * back flagged UP_F_CANCELED, for libupcall to turn into the -ECANCELED.
+ *
+ * 'actions' has the UP_ACTION() bit of every action the backend carries.
+ * The flags above say how libupcall makes up for the ones it lacks; any
+ * other action it does not carry is never submitted and completes with
+ * -EOPNOTSUPP instead.
+ */
+#define UP_ACTION(type)	(1U << (type))
+
+struct upcall_backend {
+	const char *name;
+	int (*create)(int flags);
+	int (*submit)(int upfd, int in_cnt, struct up_event *in,
+		      int out_cnt, struct up_event *out);
+	int (*submit_nowait)(int upfd, int in_cnt, struct up_event *in,
+			     int out_cnt, struct up_event *out);
+	void (*release)(void);
+	void (*cancel)(const struct up_event *cancel);
+	bool multishot;
+	bool writev;
+	bool classes;
+	bool close;
+	uint32_t actions;
+};
+
+/*
+ * Does this completion end its registration?  One-shot actions always do.
+ * A multishot registration ends on end-of-file or an error, but running
+ * out of pool buffers only costs the reader that one completion.
+ */
+static inline bool up_event_final(const struct up_event *evt)
+{
+	if (!(evt->flags & UP_F_MULTISHOT))
+		return true;
+	if (evt->result == -ENOMEM)
+		return false;
+	if (evt->type == UP_ACCEPT || evt->type == UP_POLL)
+		return evt->result < 0;
+	return evt->result <= 0;
+}
+
+/*
+ * Actions whose completions carry something in (data, a socket, readiness)
+ * rather than report on something sent.  UP_CANCEL and UP_CLOSE scrub
+ * these from completions that are reaped but not yet delivered.
+ */
+static inline bool up_action_input(up_action_t type)
+{
+	return type == UP_READ || type == UP_ACCEPT || type == UP_POLL;
+}
+
+/* Internal: see struct upcall_backend's cancel */
+#define UP_F_CANCELED	(1U << 31)
+
+/* Is evt one of the actions a UP_CANCEL on its fd hits? */
+static inline bool up_cancel_hits(const struct up_event *cancel,
+				  const struct up_event *evt)
+{
+	return evt->fd == cancel->fd &&
+	       (!(cancel->flags & UP_F_MATCH) ||
+		evt->user_data == cancel->user_data);
+}
+
+extern const struct upcall_backend upcall_kernel_backend;
+extern const struct upcall_backend upcall_epoll_backend;
+
+/*
+ * Per-worker timer wheel (upcall_timer.c).  timers_setup() runs once on
+ * each worker before its setup_fn; run_event_loop calls timers_run() and
+ * then timers_arm() ahead of every submit.  timers_teardown() drops any
+ * pending timers when the worker exits.
+ */
+void timers_setup(void);
+void timers_run(void);
+void timers_arm(void);
+void timers_teardown(void);
+
+#endif
@@ -0,0 +1,312 @@
+/**
+ * Upcall support library - per-worker timers
+ * Copyright (C) 2024 Eric B Munson
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Each worker keeps a cascading timer wheel: 256 slots of one tick at
+ * level 0, then three levels of 64 slots each covering 64 times the range
+ * of the level below, which reaches about 110 minutes with the default
+ * 100us tick.  Longer timeouts are clamped to that.  Timers are only ever
+ * touched by their own worker, so there is no locking.
+ *
+ * run_event_loop fires due timers before every submit and then points
+ * the worker's timerfd at the next expiry.  The timerfd has a multishot
+ * UP_READ outstanding, hinted at the smallest buffer class as the 8 byte
+ * count is all it reads, so upcall_submit returns by the deadline on every
+ * backend without the submit ABI needing a timeout.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "upcall_int.h"
+
+#ifndef UPCALL_TIMER_TICK_US
+#define UPCALL_TIMER_TICK_US 100
+#endif
+
+#define TICK_NS		((uint64_t)UPCALL_TIMER_TICK_US * 1000)
+
+#define L0_BITS		8
+#define LN_BITS		6
+#define L0_SIZE		(1 << L0_BITS)
+#define LN_SIZE		(1 << LN_BITS)
+#define L0_MASK		(L0_SIZE - 1)
+#define LN_MASK		(LN_SIZE - 1)
+#define NR_LEVELS	3		/* levels above level 0 */
+#define MAX_DELTA	((1ULL << (L0_BITS + NR_LEVELS * LN_BITS)) - 1)
+
+/* Index of clk's slot at level lvl (1..NR_LEVELS) */
+#define LN_INDEX(clk, lvl)	(((clk) >> (L0_BITS + ((lvl) - 1) * LN_BITS)) & LN_MASK)
+
+struct timer_wheel {
+	uint64_t		clk;		/* next tick to process */
+	uint64_t		armed;		/* tick the timerfd is set for, 0 if none */
+	size_t			nr;		/* pending timers */
+	int			tfd;
+	struct upcall_timer	*l0[L0_SIZE];
+	struct upcall_timer	*ln[NR_LEVELS][LN_SIZE];
+};
+
+static __thread struct timer_wheel *wheel;
+
+static uint64_t now_tick(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) / TICK_NS;
+}
+
+static void timer_link(struct upcall_timer **head, struct upcall_timer *t)
+{
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+static void timer_unlink(struct upcall_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next  = NULL;
+	t->pprev = NULL;
+}
+
+static void wheel_insert(struct upcall_timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+
+	if (expires < wheel->clk)
+		expires = wheel->clk;
+	delta = expires - wheel->clk;
+	if (delta > MAX_DELTA) {
+		expires = wheel->clk + MAX_DELTA;
+		delta   = MAX_DELTA;
+	}
+
+	if (delta < L0_SIZE) {
+		timer_link(&wheel->l0[expires & L0_MASK], t);
+		return;
+	}
+
+	for (int lvl = 1; lvl <= NR_LEVELS; lvl++) {
+		if (delta < 1ULL << (L0_BITS + lvl * LN_BITS)) {
+			timer_link(&wheel->ln[lvl - 1][LN_INDEX(expires, lvl)], t);
+			return;
+		}
+	}
+}
+
+/* Move every timer in slot idx of level lvl down to where it belongs now */
+static int wheel_cascade(int lvl, int idx)
+{
+	struct upcall_timer *list = wheel->ln[lvl - 1][idx];
+	struct upcall_timer *t;
+
+	wheel->ln[lvl - 1][idx] = NULL;
+	while ((t = list)) {
+		list = t->next;
+		wheel_insert(t);
+	}
+	return idx;
+}
+
+static void timer_fire(struct upcall_timer *t)
+{
+	struct up_event evt;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.fd      = -1;
+	evt.buf     = t->arg;
+	evt.type    = UP_TIMEOUT;
+	evt.flags   = UP_F_LAST;
+	evt.work_fn = t->work_fn;
+	evt.work_fn(&evt);
+}
+
+static void timerfd_wake(struct up_event *evt)
+{
+	/* The expiry count is not interesting, timers_run() checks the clock */
+	if (evt->buf)
+		return_buffer(evt->buf, evt->len);
+	if (evt->flags & UP_F_LAST)
+		add_read_multishot_hint(evt->fd, sizeof(uint64_t), timerfd_wake);
+}
+
+void timers_setup(void)
+{
+	wheel = calloc(1, sizeof(struct timer_wheel));
+	if (!wheel) {
+		perror("OOM");
+		exit(1);
+	}
+
+	wheel->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel->tfd < 0) {
+		perror("timerfd_create");
+		exit(1);
+	}
+	wheel->clk = now_tick();
+	add_read_multishot_hint(wheel->tfd, sizeof(uint64_t), timerfd_wake);
+}
+
+static void timers_forget(struct upcall_timer **head)
+{
+	struct upcall_timer *t;
+
+	while ((t = *head))
+		timer_unlink(t);
+}
+
+void timers_teardown(void)
+{
+	/* Leave the caller's timers looking never added, not dangling */
+	for (int i = 0; i < L0_SIZE; i++)
+		timers_forget(&wheel->l0[i]);
+	for (int lvl = 0; lvl < NR_LEVELS; lvl++) {
+		for (int i = 0; i < LN_SIZE; i++)
+			timers_forget(&wheel->ln[lvl][i]);
+	}
+
+	close(wheel->tfd);
+	free(wheel);
+	wheel = NULL;
+}
+
+void timers_run(void)
+{
+	struct upcall_timer *pending, *t;
+	uint64_t now;
+	int idx;
+
+	if (!wheel->nr)
+		return;
+
+	now = now_tick();
+	while (wheel->nr && wheel->clk <= now) {
+		idx = wheel->clk & L0_MASK;
+		if (!idx &&
+		    !wheel_cascade(1, LN_INDEX(wheel->clk, 1)) &&
+		    !wheel_cascade(2, LN_INDEX(wheel->clk, 2)))
+			wheel_cascade(3, LN_INDEX(wheel->clk, 3));
+
+		/*
+		 * Fire from a private list head so a callback can cancel any
+		 * timer that is still waiting its turn in this slot.
+		 */
+		pending = wheel->l0[idx];
+		wheel->l0[idx] = NULL;
+		if (pending)
+			pending->pprev = &pending;
+		wheel->clk++;
+
+		while ((t = pending)) {
+			timer_unlink(t);
+			wheel->nr--;
+			timer_fire(t);
+		}
+	}
+
+	/* Nothing left to wait for, so there is no point in ticking */
+	if (!wheel->nr)
+		wheel->clk = now + 1;
+}
+
+/*
+ * Earliest tick the worker must be awake at.  Level 0 is exact for the
+ * rest of its current revolution; anything further out is only looked at
+ * when level 0 wraps and the next slot above cascades down.
+ */
+static uint64_t timers_next(void)
+{
+	uint64_t end = (wheel->clk | L0_MASK) + 1;
+
+	if (!(wheel->clk & L0_MASK))
+		return wheel->clk;
+
+	for (uint64_t tick = wheel->clk; tick < end; tick++) {
+		if (wheel->l0[tick & L0_MASK])
+			return tick;
+	}
+	return end;
+}
+
+void timers_arm(void)
+{
+	struct itimerspec its;
+	uint64_t next;
+
+	if (!wheel->nr)
+		return;
+
+	next = timers_next();
+	if (wheel->armed && wheel->armed <= next && wheel->armed >= wheel->clk)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = next * TICK_NS / 1000000000ULL;
+	its.it_value.tv_nsec = next * TICK_NS % 1000000000ULL;
+	if (timerfd_settime(wheel->tfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+	wheel->armed = next;
+}
+
+void add_timer(struct upcall_timer *t, uint64_t usecs,
+	       void (*work_fn)(struct up_event *evt), void *arg)
+{
+	uint64_t now = now_tick();
+
+	if (t->pprev)
+		cancel_timer(t);
+
+	/* An idle wheel has stopped ticking; catch it up first */
+	if (!wheel->nr)
+		wheel->clk = now;
+
+	/* Round up and add a tick so the timer never fires early */
+	t->expires = now + (usecs + UPCALL_TIMER_TICK_US - 1) / UPCALL_TIMER_TICK_US + 1;
+	t->work_fn = work_fn;
+	t->arg     = arg;
+	wheel_insert(t);
+	wheel->nr++;
+}
+
+int cancel_timer(struct upcall_timer *t)
+{
+	if (!t->pprev)
+		return 0;
+
+	timer_unlink(t);
+	wheel->nr--;
+	return 1;
+}